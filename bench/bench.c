@@ -0,0 +1,234 @@
+/*
+ *  Synthetic client stressing a running nuwm, see bench/run.sh.
+ *
+ *  It maps, configures, focuses, moves between desktops and destroys a lot
+ *  of windows, and reports latencies as seen from the client side. Keys are
+ *  injected with XTest using the default bindings of config.h.
+ */
+
+#include <X11/X.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/Xatom.h>
+#include <X11/keysym.h>
+#include <X11/extensions/XTest.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TIMEOUT_MS 2000
+#define DESKTOPS   4
+
+typedef struct Series Series;
+struct Series {
+	const char *name;
+	double *values; /* in microseconds */
+	int size, capacity, timeouts;
+};
+
+static Display *dis;
+static Window root;
+static Atom net_active, net_client_list;
+static long long requests_before;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void die(const char *e)
+{
+	fprintf(stderr, "bench: %s\n", e);
+	exit(1);
+}
+
+static void add(Series *s, double value)
+{
+	if (s->size == s->capacity) {
+		s->capacity = s->capacity ? 2*s->capacity : 256;
+		if ((s->values = realloc(s->values, s->capacity * sizeof(double))) == NULL) die("out of memory");
+	}
+	s->values[s->size++] = value;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void report(Series *s)
+{
+	if (s->size == 0) {
+		printf("%-16s no samples, %d timeouts\n", s->name, s->timeouts);
+		return;
+	}
+	qsort(s->values, s->size, sizeof(double), cmp);
+	printf("%-16s n=%-6d p50=%8.0fus p90=%8.0fus p99=%8.0fus max=%8.0fus timeouts=%d\n", s->name, s->size,
+	       s->values[s->size / 2], s->values[s->size * 9 / 10], s->values[s->size * 99 / 100],
+	       s->values[s->size - 1], s->timeouts);
+}
+
+/* Waits for an event matching the predicate, returns 0 on timeout */
+static int wait_event(int (*match)(XEvent *, void *), void *data)
+{
+	double deadline = now() + TIMEOUT_MS * 1000.0;
+	XEvent ev;
+
+	for (;;) {
+		while (XPending(dis) > 0) {
+			XNextEvent(dis, &ev);
+			if (match(&ev, data)) return 1;
+		}
+		double left = deadline - now();
+		if (left <= 0) return 0;
+
+		struct pollfd pfd = { .fd = ConnectionNumber(dis), .events = POLLIN };
+		poll(&pfd, 1, (int)(left / 1000) + 1);
+	}
+}
+
+static int match_tiled(XEvent *ev, void *data)
+{
+	static int mapped, configured;
+
+	if (ev == NULL) {
+		mapped = configured = 0;
+		return 0;
+	}
+
+	Window win = *(Window *)data;
+	if (ev->type == MapNotify && ev->xmap.window == win) mapped = 1;
+	if (ev->type == ConfigureNotify && ev->xconfigure.window == win && ev->xconfigure.width != 1) configured = 1;
+	return mapped && configured;
+}
+
+static int match_root_property(XEvent *ev, void *data)
+{
+	return ev->type == PropertyNotify && ev->xproperty.window == root && ev->xproperty.atom == *(Atom *)data;
+}
+
+static int match_configure(XEvent *ev, void *data)
+{
+	return ev->type == ConfigureNotify && ev->xconfigure.window == *(Window *)data;
+}
+
+static void key(KeySym mod, KeySym shift, KeySym sym)
+{
+	KeyCode codes[] = {
+		mod ? XKeysymToKeycode(dis, mod) : 0,
+		shift ? XKeysymToKeycode(dis, shift) : 0,
+		XKeysymToKeycode(dis, sym),
+	};
+
+	for (int i = 0; i < 3; ++i) {
+		if (codes[i]) XTestFakeKeyEvent(dis, codes[i], True, CurrentTime);
+	}
+	for (int i = 2; i >= 0; --i) {
+		if (codes[i]) XTestFakeKeyEvent(dis, codes[i], False, CurrentTime);
+	}
+	XFlush(dis);
+}
+
+static void timed_key(Series *s, KeySym shift, KeySym sym, Atom property)
+{
+	double start = now();
+
+	key(XK_Super_L, shift, sym);
+	if (wait_event(match_root_property, &property)) {
+		add(s, now() - start);
+	} else {
+		++s->timeouts;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int n = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		if (opt == 'n') n = atoi(optarg);
+		else die("usage: bench [-n windows]");
+	}
+	if (n < 1) die("number of windows must be positive");
+
+	if ((dis = XOpenDisplay(NULL)) == NULL) die("cannot open display");
+	int event, error, major, minor;
+	if (!XTestQueryExtension(dis, &event, &error, &major, &minor)) die("XTest extension is missing");
+
+	root = DefaultRootWindow(dis);
+	net_active = XInternAtom(dis, "_NET_ACTIVE_WINDOW", False);
+	net_client_list = XInternAtom(dis, "_NET_CLIENT_LIST", False);
+	XSelectInput(dis, root, PropertyChangeMask);
+
+	Window *wins = calloc(n, sizeof(Window));
+	if (wins == NULL) die("out of memory");
+	Series map = { "map-to-tiled" }, configure = { "configure" }, focus = { "focus" };
+	Series desktop = { "desktop-switch" }, move = { "move-to-desktop" }, destroy = { "destroy" };
+
+	requests_before = NextRequest(dis);
+	for (int i = 0; i < n; ++i) {
+		wins[i] = XCreateSimpleWindow(dis, root, 0, 0, 1, 1, 0, 0, 0);
+		XSelectInput(dis, wins[i], StructureNotifyMask);
+		match_tiled(NULL, NULL);
+
+		double start = now();
+		XMapWindow(dis, wins[i]);
+		XFlush(dis);
+		if (wait_event(match_tiled, &wins[i])) {
+			add(&map, now() - start);
+		} else {
+			++map.timeouts;
+		}
+
+		// spread the windows over the desktops, the current one moves away
+		if (i % DESKTOPS != 0) timed_key(&move, XK_Shift_L, XK_1 + i % DESKTOPS, XA_WM_NAME);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		double start = now();
+		XMoveResizeWindow(dis, wins[i], 10 + i % 100, 10 + i % 100, 100 + i % 300, 100 + i % 200);
+		XFlush(dis);
+		if (wait_event(match_configure, &wins[i])) {
+			add(&configure, now() - start);
+		} else {
+			++configure.timeouts;
+		}
+	}
+
+	for (int i = 0; i < n; ++i) {
+		int d = (i + 1) % DESKTOPS;
+		timed_key(&desktop, 0, XK_1 + d, XA_WM_NAME);
+		// focus only moves, and _NET_ACTIVE_WINDOW only changes, with two windows or more
+		if (n / DESKTOPS + (d < n % DESKTOPS) >= 2) timed_key(&focus, 0, XK_Tab, net_active);
+	}
+
+	for (int i = 0; i < n; ++i) {
+		double start = now();
+		XDestroyWindow(dis, wins[i]);
+		XFlush(dis);
+		if (wait_event(match_root_property, &net_client_list)) {
+			add(&destroy, now() - start);
+		} else {
+			++destroy.timeouts;
+		}
+	}
+
+	printf("windows=%d, bench client requests=%lld\n", n, (long long)NextRequest(dis) - requests_before);
+	report(&map);
+	report(&configure);
+	report(&focus);
+	report(&desktop);
+	report(&move);
+	report(&destroy);
+
+	XCloseDisplay(dis);
+	return map.timeouts + destroy.timeouts > 0;
+}
@@ -0,0 +1,46 @@
+#!/bin/sh
+# Starts nuwm on a private Xvfb display, runs the synthetic client against
+# it and prints the client side latencies followed by nuwm's own counters.
+#
+# BENCH_DISPLAY (default: the first free one) and BENCH_WINDOWS (default
+# 1000) can be set from the environment.
+
+windows=${BENCH_WINDOWS:-1000}
+log=${TMPDIR:-/tmp}/nuwm-bench.$$.log
+displayfile=${TMPDIR:-/tmp}/nuwm-bench.$$.display
+
+command -v Xvfb >/dev/null || { echo "bench: Xvfb is not installed" >&2; exit 1; }
+
+# Xvfb writes the display number to -displayfd once it accepts clients,
+# it never does when the display is already taken by another server
+Xvfb $BENCH_DISPLAY -displayfd 3 -screen 0 1920x1080x24 -nolisten tcp 3>"$displayfile" >/dev/null 2>&1 &
+xvfb=$!
+trap 'kill $nuwm $xvfb 2>/dev/null; rm -f "$log" "$displayfile"' EXIT INT TERM
+
+for i in 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20; do
+	[ -s "$displayfile" ] && break
+	kill -0 $xvfb 2>/dev/null || break
+	sleep 0.5
+done
+[ -s "$displayfile" ] || { echo "bench: Xvfb did not start" >&2; exit 1; }
+display=:$(cat "$displayfile")
+
+DISPLAY=$display ./nuwm 2>"$log" &
+nuwm=$!
+sleep 1
+kill -0 $nuwm 2>/dev/null || { echo "bench: nuwm did not start" >&2; cat "$log" >&2; exit 1; }
+
+DISPLAY=$display ./bench/bench -n "$windows"
+status=$?
+
+# ask nuwm for its histograms and request counters
+kill -USR1 $nuwm
+sleep 1
+echo
+awk '/^stat / {
+	split($3, count, "="); split($5, requests, "="); split($6, roundtrips, "=");
+	printf "%-20s %8d calls %8.1f requests/call %6.2f roundtrips/call %s\n",
+	       $2, count[2], requests[2] / count[2], roundtrips[2] / count[2], $4
+}' "$log"
+
+exit $status
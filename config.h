@@ -12,6 +12,24 @@
 #define GAP     6
 #define BAR     25
 
+/* Windows of inactive desktops are either moved below the screen (HIDE_MOVE)
+ * or unmapped (HIDE_UNMAP), so that clients can stop rendering them */
+#define HIDE_MODE HIDE_UNMAP
+
+/* configure requests of a tiled window beyond STORM_COUNT within STORM_MS are ignored */
+#define STORM_COUNT 10
+#define STORM_MS    1000
+
+/* windows supporting _NET_WM_SYNC_REQUEST are resized again once they have repainted, or
+ * after SYNC_TIMEOUT_MS, other windows being dragged at most RESIZE_HZ times per second */
+#define RESIZE_HZ       60
+#define SYNC_TIMEOUT_MS 200
+
+/* MOD+drag moves or resizes floating windows, at most DRAG_HZ times per second */
+#define MOVE_BUTTON   Button1
+#define RESIZE_BUTTON Button3
+#define DRAG_HZ       60
+
 /* move/resize steps (in pixels) */
 #define MOVE_STEP   40
 #define RESIZE_STEP 15
@@ -57,6 +75,7 @@ static struct Key keys[] = {
 	{ MOD,                    XK_f,          toggle_float,   { NULL }               },
 	{ MOD,                    XK_space,      swap_master,    { NULL }               },
 	{ MOD,                    XK_comma,      switch_mode,    { NULL }               },
+	{ MOD,                    XK_period,     next_monitor,   { NULL }               },
 
 	{ MOD,                    XK_h,          smart_hjkl,     { .i = XK_h }          },
 	{ MOD,                    XK_j,          smart_hjkl,     { .i = XK_j }          },
@@ -27,19 +27,102 @@
 #include <X11/Xproto.h>
 #include <X11/Xatom.h>
 #include <X11/XF86keysym.h>
+#ifdef XSYNC
+#include <X11/extensions/sync.h>
+#endif
+#ifdef XINPUT2
+#include <X11/extensions/XInput2.h>
+#endif
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef XCB
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#ifdef __linux__
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#endif
 #include <sys/wait.h>
+#include <time.h>
+
+/* Every Xlib call waiting for a reply counts as a round trip, wherever it is made */
+#define COUNTED(call) (++roundtrips, call)
+#define XAllocNamedColor(...) COUNTED(XAllocNamedColor(__VA_ARGS__))
+#define XGetClassHint(...) COUNTED(XGetClassHint(__VA_ARGS__))
+#define XGetGeometry(...) COUNTED(XGetGeometry(__VA_ARGS__))
+#define XGetWMNormalHints(...) COUNTED(XGetWMNormalHints(__VA_ARGS__))
+#define XGetWMProtocols(...) COUNTED(XGetWMProtocols(__VA_ARGS__))
+#define XGetWindowAttributes(...) COUNTED(XGetWindowAttributes(__VA_ARGS__))
+#define XGetWindowProperty(...) COUNTED(XGetWindowProperty(__VA_ARGS__))
+#define XInternAtom(...) COUNTED(XInternAtom(__VA_ARGS__))
+#define XQueryExtension(...) COUNTED(XQueryExtension(__VA_ARGS__))
+#define XQueryPointer(...) COUNTED(XQueryPointer(__VA_ARGS__))
+#define XQueryTree(...) COUNTED(XQueryTree(__VA_ARGS__))
+#define XSync(...) COUNTED(XSync(__VA_ARGS__))
+#ifdef XSYNC
+#define XSyncInitialize(...) COUNTED(XSyncInitialize(__VA_ARGS__))
+#define XSyncQueryCounter(...) COUNTED(XSyncQueryCounter(__VA_ARGS__))
+#define XSyncQueryExtension(...) COUNTED(XSyncQueryExtension(__VA_ARGS__))
+#endif
+#ifdef XINPUT2
+#define XIQueryVersion(...) COUNTED(XIQueryVersion(__VA_ARGS__))
+#endif
+#ifdef XRANDR
+#define XRRGetCrtcInfo(...) COUNTED(XRRGetCrtcInfo(__VA_ARGS__))
+#define XRRGetScreenResourcesCurrent(...) COUNTED(XRRGetScreenResourcesCurrent(__VA_ARGS__))
+#define XRRQueryExtension(...) COUNTED(XRRQueryExtension(__VA_ARGS__))
+#endif
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
 #define MAX(a,b) (((a)>(b))?(a):(b))
 #define TABLENGTH(x) (sizeof(x)/sizeof(*x))
+#define INDEX_SIZE 512 /* number of buckets in the window index, power of two */
+#define IGNORED_SERIALS 64 /* requests whose errors are expected and dropped */
+#define POOL_CHUNK 64 /* clients allocated at once */
+
+#define TRACE_SIZE 4096 /* records in the trace ring, power of two */
+#define HIST_SIZE 20     /* latency buckets, bucket i counts calls faster than 2^i us */
+#define ROUNDTRIP() (++roundtrips) /* put where XCB waits for a batch of replies */
+#define DRAG_MASK (ButtonPressMask | ButtonReleaseMask | PointerMotionMask)
+#define IPC_CLIENTS 16 /* connections to the IPC socket served at once */
+#define MAX_MONITORS 8
+#define MAX_STATES 16 /* _NET_WM_STATE atoms kept per window */
+#ifdef XINPUT2
+#define CLICK_ON_ROOT have_xi /* click-to-focus without grabs on the clients */
+#else
+#define CLICK_ON_ROOT 0
+#endif
+
+#define LOG_ERROR 0
+#define LOG_INFO  1
+#define LOG_DEBUG 2
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
 
-#define LOG(fmt, ...) fprintf(stderr, "%s:%d:%s " fmt "\n", __FILE__, __LINE__, __func__, ##__VA_ARGS__)
+// the trailing "" fills the last %s, so that calls without arguments stay valid C99
+#define LOGL(level, ...) LOGL_(level, __VA_ARGS__, "")
+#define LOGL_(level, fmt, ...) do { \
+		if ((level) <= LOG_LEVEL) fprintf(stderr, "%s:%d:%s " fmt "%s\n", __FILE__, __LINE__, __func__, __VA_ARGS__); \
+	} while (0)
+#define LOG(...) LOGL(LOG_INFO, __VA_ARGS__)
+#define DEBUG(...) LOGL(LOG_DEBUG, __VA_ARGS__)
 
 // Types visible from config.h
 typedef union {
@@ -61,11 +144,14 @@ struct Rule {
 	const int ignore_unmaps;
 };
 
+enum { HIDE_MOVE, HIDE_UNMAP };
+
 
 // Functions visible from config.h (public)
 static void change_desktop(const Arg *);
 static void client_to_desktop(const Arg *);
 static void kill_client(const Arg *);
+static void next_monitor(const Arg *);
 static void next_win(const Arg *);
 static void prev_win(const Arg *);
 static void quit(const Arg *);
@@ -78,80 +164,368 @@ static void toggle_float(const Arg *);
 static void write_debug(const Arg *);
 
 #include "config.h"
+#include "snapshot.h"
+
+#if DESKTOPS_SIZE > SNAPSHOT_DESKTOPS
+#error "DESKTOPS_SIZE does not fit in the snapshot, raise SNAPSHOT_DESKTOPS"
+#endif
 
 // Types not visible from config.h (public)
+/* Size constraints of a window from WM_NORMAL_HINTS, 0 when not set */
+typedef struct SizeHints SizeHints;
+struct SizeHints {
+	int basew, baseh, incw, inch, minw, minh, maxw, maxh;
+};
+
 typedef struct Client Client;
 struct Client {
-	Client *next;
+	Client *next, *prev; /* prev of the head is the tail of the list */
+	Client *hnext; /* next client in the same window index bucket */
 	Window win;
+	int desktop;
 	int isfull, isfloat;
 	int ignore_unmaps;
 	int force_full;
 
 	int x, y, w, h; /* to save position of floating windows */
+	int gx, gy, gw, gh, gbw; /* geometry and border last sent to the server */
+	SizeHints hints;
+	unsigned long long storm_start; /* configure requests of tiled windows are damped */
+	int storm_count;
+
+	int pending; /* a resize waits in px, py, pw, ph, pbw until the client caught up */
+	int px, py, pw, ph, pbw;
+	unsigned long long resized_at;
+#ifdef XSYNC
+	XSyncCounter counter; /* _NET_WM_SYNC_REQUEST_COUNTER, None when unsupported */
+	XSyncAlarm alarm;
+	unsigned long long sync_value; /* last value asked for, 0 before the first request */
+	unsigned long long sync_deadline; /* when to give up waiting, 0 when not waiting */
+#endif
+	int hidden;
+	int mapped; /* by nuwm, new windows stay unmapped until they are placed */
+	int pending_unmaps; /* unmaps done by nuwm itself, not to be taken as withdrawals */
+	int published_desktop; /* _NET_WM_DESKTOP as last written, 0 before the first time */
+	Atom states[MAX_STATES]; /* _NET_WM_STATE atoms set by the client, nuwm only adds its own */
+	int nstates;
+	int urgent; /* asked to be activated by itself, until it gets the focus */
+	int published_state; /* fullscreen, hidden and urgent bits as last written, -1 before the first time */
+};
+
+/* What nuwm has to know about a window before managing it */
+typedef struct WinInfo WinInfo;
+struct WinInfo {
+	int override_redirect;
+	int x, y, w, h;
+	char class[256], instance[256];
+	Atom states[MAX_STATES]; /* _NET_WM_STATE */
+	int nstates;
+	SizeHints hints;
+	unsigned long counter; /* _NET_WM_SYNC_REQUEST_COUNTER */
+	int sync_request; /* _NET_WM_SYNC_REQUEST is listed in WM_PROTOCOLS */
+};
+
+typedef struct Pool Pool;
+struct Pool {
+	Pool *next;
+	Client clients[POOL_CHUNK];
 };
 
 typedef struct Desktop Desktop;
 struct Desktop{
 	int master_size, mode;
 	Client *head, *current;
+	int monitor; /* monitor showing the desktop, -1 when hidden */
+	int origin_x, origin_y; /* of the monitor floating windows were last placed on */
+	int shown; /* its windows are on the screen */
+};
+
+/* Output area, each one shows a desktop */
+typedef struct Monitor Monitor;
+struct Monitor {
+	int x, y, w, h;
+	int desktop;
+};
+
+/* Fixed size record of the trace ring, written for every handled event */
+typedef struct Trace Trace;
+struct Trace {
+	unsigned long long time; /* monotonic, in nanoseconds */
+	unsigned long win;
+	unsigned int duration;   /* time spent in the handler, in nanoseconds */
+	int type;
+};
+
+/* Latency histogram and request counters of an event handler or an action */
+typedef struct Stat Stat;
+struct Stat {
+	unsigned long count, requests, roundtrips;
+	unsigned long long total; /* in nanoseconds */
+	unsigned long hist[HIST_SIZE];
+};
+
+typedef struct Probe Probe;
+struct Probe {
+	unsigned long long time;
+	unsigned long requests, roundtrips;
+};
+
+/* Floating window being moved or resized with the pointer */
+typedef struct Drag Drag;
+struct Drag {
+	Client *client; /* NULL when no drag is going on */
+	unsigned int button;
+	int start_x, start_y; /* pointer position at the press */
+	int x, y, w, h; /* window geometry at the press */
+	int pointer_x, pointer_y; /* latest pointer position */
+	int moved; /* the pointer moved since the last update */
+	unsigned long long applied_at;
+};
+
+/* Connection to the IPC socket, commands are read line by line */
+typedef struct IpcClient IpcClient;
+struct IpcClient {
+	int fd; /* -1 when the slot is free */
+	int subscribed; /* state changes are pushed to it */
+	int length;
+	char buf[256];
 };
 
 enum { MONOCLE, VSTACK, HSTACK, MODE };
-enum { WM_PROTOCOLS, WM_DELETE_WINDOW, WM_COUNT };
-enum { NET_SUPPORTED, NET_WM_CHECK, NET_FULLSCREEN, NET_WM_STATE, NET_ACTIVE, NET_CLIENT_LIST, NET_COUNT };
+enum { STAT_CHANGE_DESKTOP, STAT_FLUSH, STAT_TILE, STAT_UPDATE_FOCUS, STAT_WRITE_INFO, STAT_COUNT };
+enum { DIRTY_DESKTOP = 1 << 0, DIRTY_LAYOUT = 1 << 1, DIRTY_FOCUS = 1 << 2, DIRTY_STATUS = 1 << 3 };
+enum { WM_PROTOCOLS, WM_DELETE_WINDOW, WM_STATE, WM_COUNT };
+enum { NET_SUPPORTED, NET_WM_CHECK, NET_FULLSCREEN, NET_HIDDEN, NET_WM_STATE, NET_ACTIVE, NET_CLIENT_LIST,
+       NET_SYNC_REQUEST, NET_SYNC_COUNTER, NET_NUMBER_OF_DESKTOPS, NET_CURRENT_DESKTOP, NET_WM_DESKTOP,
+       NET_CLIENT_LIST_STACKING, NET_WORKAREA, NET_DEMANDS_ATTENTION, NET_COUNT };
 
 // Global variables
 static Display *dis;
+#ifdef XCB
+static xcb_connection_t *xcb;
+#endif
 static int bool_quit;
+static int keep_clients; /* nuwm quits on a signal, the windows are not closed */
+#ifdef XSYNC
+static int have_sync, sync_event_base;
+#endif
+#ifdef XINPUT2
+static int have_xi, xi_opcode;
+static Window pointer_win = None; /* top-level window under the pointer */
+#endif
 static int screen, sh, sw;
 static Window root, wmcheckwin;
 
 static int current_desktop;
+static Monitor monitors[MAX_MONITORS];
+static int nmonitors = 0, selmon = 0; /* the current desktop is the one of the selected monitor */
+#ifdef XRANDR
+static int have_randr, randr_event_base;
+#endif
 static Desktop desktops[DESKTOPS_SIZE];
+static Client *winindex[INDEX_SIZE];
+static Pool *pools = NULL;
+static Client *free_clients = NULL;
 
 static unsigned int win_focus, win_unfocus;
 static Atom wmatoms[WM_COUNT], netatoms[NET_COUNT];
 static int (*xerrorxlib)(Display *, XErrorEvent *);
 static unsigned int ignored_modifiers_mask = 0;
+static KeyCode keycodes[TABLENGTH(keys)]; /* keycode each key is grabbed with */
+static unsigned short *keytable = NULL; /* keycode x modifiers -> first index in keys[] + 1 */
+static unsigned short keynext[TABLENGTH(keys)]; /* next key with the same keycode and modifiers + 1 */
+static unsigned char modindex[256]; /* modifier state -> column in keytable */
+static int modcolumns = 0;
+static unsigned long suppressed_requests = 0;
+static unsigned long damped_requests = 0;
+static unsigned int dirty = 0; /* stages to run once the pending events are handled */
+static unsigned long nevents = 0, nbatches = 0;
+static unsigned long ignored_serials[IGNORED_SERIALS];
+static unsigned int ignored_serials_pos = 0;
+static Client *focused = NULL; /* client with focused border and without button grabs */
+static Drag drag;
+static int ipc_fd = -1;
+static char ipc_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static IpcClient ipc_clients[IPC_CLIENTS];
+static struct { int mode, nclients; } ipc_desktops[DESKTOPS_SIZE]; /* as last pushed to subscribers */
+static int ipc_current = 0;
+static Window ipc_focus = None;
+static Snapshot *snapshot = NULL; /* shared with readers, see snapshot.h */
+static char snapshot_path[PATH_MAX];
+static const char *mode_names[MODE] = { [MONOCLE] = "monocle", [VSTACK] = "vstack", [HSTACK] = "hstack" };
+static Window *stacking = NULL, *stacking_applied = NULL; /* top to bottom */
+static int stacking_applied_size = 0, stacking_capacity = 0;
+static Window *clientlist = NULL, *clientlist_published = NULL;
+static int clientlist_published_size = -1, clientlist_capacity = 0;
+static Window *stacklist = NULL, *stacklist_published = NULL; /* bottom to top, for _NET_CLIENT_LIST_STACKING */
+static int stacklist_published_size = -1, stacklist_capacity = 0;
+static int desktop_published = 0; /* _NET_CURRENT_DESKTOP as last written, plus one */
+static Window active_published = (Window) -1; /* _NET_ACTIVE_WINDOW as last written, -1 before the first time */
+static char status_published[512];
+static long workarea_published[4 * (DESKTOPS_SIZE - 1)];
+static Trace traces[TRACE_SIZE];
+static unsigned long long ntraces = 0;
+static volatile sig_atomic_t dump_requested = 0;
+#ifdef __linux__
+static int signal_fd = -1, timer_fd = -1; /* polled along with the X connection */
+static unsigned long long timer_armed = 0; /* deadline set on timer_fd, 0 when disarmed */
+#endif
+static unsigned long roundtrips = 0;
+static Stat event_stats[LASTEvent], action_stats[STAT_COUNT];
+static const char *action_names[STAT_COUNT] = {
+	[STAT_CHANGE_DESKTOP] = "change_desktop",
+	[STAT_FLUSH]          = "flush",
+	[STAT_TILE]           = "tile",
+	[STAT_UPDATE_FOCUS]   = "update_focus",
+	[STAT_WRITE_INFO]     = "write_info",
+};
 
 
 // Event handlers
 static void buttonpress(XEvent *e);
+static void buttonrelease(XEvent *);
 static void clientmessage(XEvent *);
+static void configurenotify(XEvent *);
 static void configurerequest(XEvent *);
 static void destroynotify(XEvent *);
+#ifdef XINPUT2
+static void enternotify(XEvent *);
+static void genericevent(XEvent *);
+static void leavenotify(XEvent *);
+#endif
 static void unmapnotify(XEvent *);
 static void keypress(XEvent *);
+static void mappingnotify(XEvent *);
 static void maprequest(XEvent *);
+static void motionnotify(XEvent *);
+static void propertynotify(XEvent *);
 
 static void (*events[LASTEvent])(XEvent *e) = {
 	[ClientMessage]    = clientmessage,
+	[ConfigureNotify]  = configurenotify,
 	[ConfigureRequest] = configurerequest,
 	[DestroyNotify]    = destroynotify,
 	[UnmapNotify]      = unmapnotify,
 	[KeyPress]         = keypress,
 	[MapRequest]       = maprequest,
+	[MappingNotify]    = mappingnotify,
 	[ButtonPress]      = buttonpress,
+	[ButtonRelease]    = buttonrelease,
+	[MotionNotify]     = motionnotify,
+	[PropertyNotify]   = propertynotify,
+#ifdef XINPUT2
+	[EnterNotify]      = enternotify,
+	[GenericEvent]     = genericevent,
+	[LeaveNotify]      = leavenotify,
+#endif
+};
+
+// Actions that can be run through the IPC socket, with an integer argument or without
+static const struct {
+	const char *name;
+	void (*function)(const Arg *);
+	int has_arg;
+} commands[] = {
+	{ "change_desktop",    change_desktop,    1 },
+	{ "client_to_desktop", client_to_desktop, 1 },
+	{ "kill_client",       kill_client,       0 },
+	{ "next_monitor",      next_monitor,      0 },
+	{ "next_win",          next_win,          0 },
+	{ "prev_win",          prev_win,          0 },
+	{ "quit",              quit,              0 },
+	{ "resize_master",     resize_master,     1 },
+	{ "swap_master",       swap_master,       0 },
+	{ "switch_mode",       switch_mode,       0 },
+	{ "toggle_float",      toggle_float,      0 },
 };
 
 // Private functions
-static void copy_client(Client *, int);
+#ifdef XSYNC
+static void alarmnotify(XEvent *);
+#endif
+static Client *alloc_client(void);
+static void apply_hints(Client *, int *, int *);
+static void attach_client(Client *, int);
 static void cleanup();
+static Monitor *desktop_monitor(int);
+static void detach_client(Client *);
 static void die(const char *);
+static unsigned long long drag_update(void);
+static void dump_stat(const char *, Stat *);
+static void dump_stats(void);
+static void dump_trace(void);
+static void expect_error(void);
+static void flush(void);
 static unsigned long getcolor(const char *);
-static Atom getprop(Window, Atom prop);
+static void gethints(Window, SizeHints *);
+static void getinfo(Window, WinInfo *);
+#ifndef XCB
+static Atom getprop(Window, Atom, Atom);
+#endif
+static void grabbuttons(Window);
+static void grabdrag(void);
+static void grabkey(KeyCode, unsigned int, int);
 static void grabkeys(void);
+static void index_add(Client *);
+static void index_remove(Client *);
+static void hide_client(Client *);
+static void hide_desktop(int);
+static void ipc_close(IpcClient *);
+static void ipc_command(IpcClient *, char *);
+static void ipc_handle(struct pollfd *, int);
+static int ipc_pollfds(struct pollfd *);
+static void ipc_publish(IpcClient *);
+static void ipc_send(IpcClient *, const char *);
+static void ipc_setup(void);
 static void move_resize_floating(Client *, int, int, int, int);
-static void remove_client(Client *, int);
+static unsigned long long now(void);
+static unsigned long long pace_deadline(Client *);
+static void place_client(Client *, int, int, int, int, int);
+static unsigned long long place_pending(void);
+static void probe_start(Probe *);
+static unsigned long long probe_stop(Probe *, Stat *);
+static void link_client(Desktop *, Client *, Client *);
+#ifdef XCB
+static void readclass(xcb_get_property_cookie_t, WinInfo *);
+static void readcounter(xcb_get_property_cookie_t, WinInfo *);
+static void readhints(xcb_get_property_cookie_t, SizeHints *);
+static void readprotocols(xcb_get_property_cookie_t, WinInfo *);
+static void readstate(xcb_get_property_cookie_t, WinInfo *);
+#else
+static void readclass(Window, WinInfo *);
+static void readprotocols(Window, WinInfo *);
+static void readstate(Window, WinInfo *);
+#endif
+static void remove_client(Client *);
+static void runtime_path(char *, size_t, const char *);
+static void restack(void);
+static void send_configure(Client *);
 static void send_kill_signal(Window);
 static void setfullscreen(Client *, int);
+static void setnetstate(Client *);
+static void setwmstate(Client *, long);
 static void setup(void);
+static void show_client(Client *);
+static void snapshot_setup(void);
+static void snapshot_write(void);
+static void handle_signals(void);
+#ifndef __linux__
 static void sigchld(int);
+static void sigusr1(int);
+#endif
 static void start(void);
+#ifdef XSYNC
+static void sync_request(Client *);
+#endif
 static void tile(void);
+static void tile_monitor(Monitor *);
+static void trace(XEvent *, unsigned long long, unsigned long long);
+static void unlink_client(Desktop *, Client *);
 static void update_focus(void);
+static void update_monitors(void);
+static void wait_events(unsigned long long);
 static void write_info(void);
+static void write_stacking(void);
 static int xerror(Display *, XErrorEvent *);
 static int xerrorstart(Display *, XErrorEvent *);
 static int wintoclient(Window, Client **, int *);
@@ -159,20 +533,21 @@ static int wintoclient(Window, Client **, int *);
 // Implementation of public functions
 void change_desktop(const Arg *arg)
 {
-	if (arg->i < 1 || arg->i == current_desktop) return;
+	if (arg->i < 1 || arg->i >= DESKTOPS_SIZE || arg->i == current_desktop) return;
 	LOG("change desktop: %d -> %d", current_desktop, arg->i);
 
-	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
-		if (i == arg->i) continue;
-		for (Client *c = desktops[i].head; c != NULL; c = c->next) {
-			if (i != current_desktop || desktops[i].current != c) XMoveWindow(dis, c->win, 0, sh + 5);
-		}
+	// a desktop shown on another monitor is not moved, that monitor gets selected
+	if (desktops[arg->i].monitor >= 0) {
+		selmon = desktops[arg->i].monitor;
+	} else {
+		desktops[current_desktop].monitor = -1;
+		desktops[arg->i].monitor = selmon;
+		monitors[selmon].desktop = arg->i;
 	}
-	if (desktops[current_desktop].current != NULL) XMoveWindow(dis, desktops[current_desktop].current->win, 0, sh + 5);
-	current_desktop = arg->i;
 
-	tile();
-	write_info();
+	// windows are hidden and shown together in the next flush
+	current_desktop = arg->i;
+	dirty |= DIRTY_DESKTOP | DIRTY_LAYOUT | DIRTY_STATUS;
 }
 
 void client_to_desktop(const Arg *arg)
@@ -182,12 +557,15 @@ void client_to_desktop(const Arg *arg)
 	Client *current = desktops[current_desktop].current;
 	LOG("client to desktop: %d -> %d, client = %p", current_desktop, arg->i, (void *) current);
 
-	XMoveWindow(dis, current->win, 0, sh + 5);
-	copy_client(current, arg->i);
-	remove_client(current, current_desktop);
+	hide_client(current);
+	detach_client(current);
+	attach_client(current, arg->i);
 
-	tile();
-	write_info();
+	// floating windows keep their place relative to the monitor, see tile_monitor()
+	current->x += desktops[arg->i].origin_x - desktops[current_desktop].origin_x;
+	current->y += desktops[arg->i].origin_y - desktops[current_desktop].origin_y;
+
+	dirty |= DIRTY_LAYOUT | DIRTY_STATUS;
 }
 
 void kill_client(const Arg *arg)
@@ -207,6 +585,15 @@ void kill_client(const Arg *arg)
 	}
 }
 
+void next_monitor(const Arg *arg)
+{
+	if (nmonitors < 2) return;
+
+	selmon = (selmon + 1) % nmonitors;
+	current_desktop = monitors[selmon].desktop;
+	dirty |= DIRTY_FOCUS | DIRTY_STATUS;
+}
+
 void next_win(const Arg *arg)
 {
 	Client *current = desktops[current_desktop].current;
@@ -217,7 +604,7 @@ void next_win(const Arg *arg)
 	if (next == NULL) next = head;
 
 	desktops[current_desktop].current = next;
-	update_focus();
+	dirty |= DIRTY_FOCUS;
 }
 
 void prev_win(const Arg *arg)
@@ -226,11 +613,8 @@ void prev_win(const Arg *arg)
 	Client *head = desktops[current_desktop].head;
 	if (current == NULL || head == NULL || current->isfull) return;
 
-	Client *prev = head;
-	for (; prev->next != current && prev->next != NULL; prev = prev->next);
-	if (current != head && prev->next == NULL) die("something wrong with client list");
-	desktops[current_desktop].current = prev;
-	update_focus();
+	desktops[current_desktop].current = current->prev;
+	dirty |= DIRTY_FOCUS;
 }
 
 void quit(const Arg *arg)
@@ -243,18 +627,16 @@ void resize_master(const Arg *arg)
 	if (!arg || !arg->i) return;
 
 	desktops[current_desktop].master_size = MIN(MAX(desktops[current_desktop].master_size + arg->i, 10), 90);
-	tile();
+	dirty |= DIRTY_LAYOUT;
 }
 
 void smart_hjkl(const Arg *arg)
 {
 	Client *current = desktops[current_desktop].current;
 	if (current != NULL && current->isfloat) {
-		XWindowAttributes wa;
-		XGetWindowAttributes(dis, current->win, &wa);
-
-		int x = wa.x, y = wa.y;
-		int w = wa.width, h = wa.height;
+		// floating geometry is always known, no need to ask the server
+		int x = current->x, y = current->y;
+		int w = current->w, h = current->h;
 		switch (arg->i) {
 		case XK_h: x -= MOVE_STEP; break;
 		case XK_j: y += MOVE_STEP; break;
@@ -311,6 +693,11 @@ void spawn(const Arg *arg)
 			if (dup2(fdnull, STDERR_FILENO) < 0) die("cannot redirect stderr to /dev/null");
 			if (fdnull > 2) close(fdnull);
 
+			// signals handled through signalfd are blocked, the command must not inherit that
+			sigset_t signals;
+			sigemptyset(&signals);
+			sigprocmask(SIG_SETMASK, &signals, NULL);
+
 			setsid();
 			execvp(((char**)arg->com)[0], (char**)arg->com);
 		}
@@ -325,26 +712,20 @@ void swap_master(const Arg *arg)
 
 	if (head == NULL || current == NULL || current == head) return;
 
-	Client *prev = head;
-	for (; prev->next != current && prev->next != NULL; prev = prev->next);
-	if (prev->next == NULL) die("something wrong with client list");
-
-	prev->next = head;
+	// the current client becomes the head, the head takes its place
+	Client *after = current->next;
+	unlink_client(&desktops[current_desktop], current);
+	link_client(&desktops[current_desktop], current, head);
+	unlink_client(&desktops[current_desktop], head);
+	link_client(&desktops[current_desktop], head, after);
 
-	// exchange prev/next pointers
-	Client *tmp = current->next;
-	current->next = head->next;
-	head->next = tmp;
-	desktops[current_desktop].head = current;
-
-	tile();
+	dirty |= DIRTY_LAYOUT;
 }
 
 void switch_mode(const Arg *arg)
 {
 	desktops[current_desktop].mode = (desktops[current_desktop].mode + 1) % MODE;
-	tile();
-	write_info();
+	dirty |= DIRTY_LAYOUT | DIRTY_STATUS;
 }
 
 void toggle_float(const Arg *arg)
@@ -354,10 +735,10 @@ void toggle_float(const Arg *arg)
 
 	current->isfloat = !current->isfloat;
 	if (current->isfloat) {
-		move_resize_floating(current, sw - 480 - 2*BORDER, sh - 360 - 2*BORDER, 480, 360);
-		XSetWindowBorderWidth(dis, current->win, BORDER);
+		Monitor *m = &monitors[selmon];
+		move_resize_floating(current, m->x + m->w - 480 - 2*BORDER, m->y + m->h - 360 - 2*BORDER, 480, 360);
 	}
-	tile();
+	dirty |= DIRTY_LAYOUT;
 }
 
 void write_debug(const Arg *unused)
@@ -370,18 +751,56 @@ void write_debug(const Arg *unused)
 			LOG("\twindow %lu: current = %d, float = %d, next = %lu", c->win, is_cur, c->isfloat, next);
 		}
 	}
+	LOG("suppressed requests = %lu", suppressed_requests);
+	LOG("damped configure requests = %lu", damped_requests);
+	LOG("events = %lu, batches = %lu, requests = %lu", nevents, nbatches, NextRequest(dis) - 1);
+	dump_trace();
+	dump_stats();
 }
 
 // Implementation of event handlers
 void buttonpress(XEvent *e)
 {
+	XButtonEvent *ev = &e->xbutton;
 	Client *c = NULL;
 	int desktop;
-	if (wintoclient(e->xbutton.window, &c, &desktop) && desktop == current_desktop
-	    && c != desktops[current_desktop].current) {
+
+	// presses grabbed on the root window are for the top-level window under the pointer
+	Window win = ev->window == root ? ev->subwindow : ev->window;
+	if (!wintoclient(win, &c, &desktop) || desktops[desktop].monitor < 0) return;
+	if (desktop != current_desktop) {
+		// a click on another monitor selects it
+		selmon = desktops[desktop].monitor;
+		current_desktop = desktop;
+		dirty |= DIRTY_FOCUS | DIRTY_STATUS;
+	}
+	if (c != desktops[current_desktop].current) {
 		desktops[current_desktop].current = c;
-		update_focus();
+		dirty |= DIRTY_FOCUS;
 	}
+
+	if (ev->window == root && c->isfloat && !c->isfull && (ev->state & ~ignored_modifiers_mask & 0xff) == MOD
+	    && (ev->button == MOVE_BUTTON || ev->button == RESIZE_BUTTON)) {
+		drag.client = c;
+		drag.button = ev->button;
+		drag.start_x = drag.pointer_x = ev->x_root;
+		drag.start_y = drag.pointer_y = ev->y_root;
+		drag.x = c->x;
+		drag.y = c->y;
+		drag.w = c->w;
+		drag.h = c->h;
+		drag.moved = 0;
+	}
+}
+
+void buttonrelease(XEvent *e)
+{
+	if (drag.client == NULL || e->xbutton.button != drag.button) return;
+
+	// the window ends up where the pointer was released, whatever the rate limit says
+	drag.applied_at = 0;
+	drag_update();
+	drag.client = NULL;
 }
 
 void clientmessage(XEvent *e)
@@ -390,8 +809,27 @@ void clientmessage(XEvent *e)
 	Client *c = NULL;
 	int desktop;
 
+	// pagers count desktops from 0, nuwm from 1
+	if (ev->window == root && ev->message_type == netatoms[NET_CURRENT_DESKTOP]) {
+		if (ev->data.l[0] >= 0 && ev->data.l[0] < DESKTOPS_SIZE - 1) change_desktop(&(const Arg){ .i = ev->data.l[0] + 1 });
+		return;
+	}
+
 	if (!wintoclient(ev->window, &c, &desktop)) return;
-	if (ev->message_type == netatoms[NET_WM_STATE]
+	if (ev->message_type == netatoms[NET_ACTIVE]) {
+		// only pagers act for the user, applications may not steal the focus
+		if (ev->data.l[0] != 2) {
+			if (c != focused && !c->urgent) {
+				c->urgent = 1;
+				setnetstate(c);
+			}
+			return;
+		}
+		// the window may be on another desktop, go there
+		if (desktop != current_desktop) change_desktop(&(const Arg){ .i = desktop });
+		desktops[desktop].current = c;
+		dirty |= DIRTY_FOCUS;
+	} else if (ev->message_type == netatoms[NET_WM_STATE]
 	    && ((unsigned)ev->data.l[1] == netatoms[NET_FULLSCREEN] || (unsigned)ev->data.l[2] == netatoms[NET_FULLSCREEN])) {
 		setfullscreen(c, (ev->data.l[0] == 1 || (ev->data.l[0] == 2 && !c->isfull)));
 		if (c->force_full) {
@@ -400,11 +838,22 @@ void clientmessage(XEvent *e)
 	}
 }
 
+void configurenotify(XEvent *e)
+{
+	XConfigureEvent *ev = &e->xconfigure;
+
+	// without XRandR, the size of the root window is all there is to know
+	if (ev->window != root || (ev->width == sw && ev->height == sh)) return;
+	sw = ev->width;
+	sh = ev->height;
+	update_monitors();
+}
+
 void configurerequest(XEvent *e)
 {
 	// Paste from DWM, thx again \o/
 	XConfigureRequestEvent *ev = &e->xconfigurerequest;
-	LOG("configure request, win=%lu", ev->window);
+	DEBUG("configure request, win=%lu", ev->window);
 	XWindowChanges wc = {
 		.x = ev->x,
 		.y = ev->y,
@@ -414,14 +863,43 @@ void configurerequest(XEvent *e)
 		.sibling = ev->above,
 		.stack_mode = ev->detail,
 	};
-	XConfigureWindow(dis, ev->window, ev->value_mask, &wc);
+	unsigned long mask = ev->value_mask;
 
-	Client *c;
-	if (wintoclient(ev->window, &c, NULL) && c->isfloat && !c->isfull) {
-		move_resize_floating(c, ev->x, ev->y, ev->width, ev->height);
+	Client *c = NULL;
+	if (wintoclient(ev->window, &c, NULL) && (!c->isfloat || c->isfull)) {
+		// tiled and fullscreen windows keep their place, they are only told where it is
+		unsigned long long t = now();
+		if (t - c->storm_start > STORM_MS * 1000000ULL) {
+			c->storm_start = t;
+			c->storm_count = 0;
+		}
+		if (++c->storm_count > STORM_COUNT) {
+			// the window keeps fighting the layout, stop answering for a while
+			if (c->storm_count == STORM_COUNT + 1) LOG("damping configure requests of win=%lu", c->win);
+			++damped_requests;
+			return;
+		}
+		send_configure(c);
+		return;
+	}
+
+	// windows of hidden desktops have to stay off the screen
+	if (c != NULL && c->hidden) mask &= ~(CWX | CWY);
+
+	// the window may be gone already, its errors are dropped in xerror()
+	expect_error();
+	XConfigureWindow(dis, ev->window, mask, &wc);
+	if (mask & CWStackMode) stacking_applied_size = 0;
+
+	if (c != NULL) {
+		// keep the geometry cache in sync with what the window was just given
+		if (mask & CWX) c->gx = ev->x;
+		if (mask & CWY) c->gy = ev->y;
+		if (mask & CWWidth) c->gw = ev->width;
+		if (mask & CWHeight) c->gh = ev->height;
+		if (mask & CWBorderWidth) c->gbw = ev->border_width;
+		if (!c->hidden) move_resize_floating(c, ev->x, ev->y, ev->width, ev->height);
 	}
-	XSync(dis, False);
-	tile();
 }
 
 void destroynotify(XEvent *e)
@@ -430,11 +908,11 @@ void destroynotify(XEvent *e)
 	Client *c = NULL;
 	int desktop;
 
-	LOG("destroynotify win=%lu", ev->window);
+	DEBUG("destroynotify win=%lu", ev->window);
 	if (wintoclient(ev->window, &c, &desktop)) {
-		remove_client(c, desktop);
+		remove_client(c);
 	}
-	tile();
+	dirty |= DIRTY_LAYOUT;
 }
 
 void unmapnotify(XEvent *e)
@@ -443,102 +921,237 @@ void unmapnotify(XEvent *e)
 	Client *c;
 	int desktop;
 
-	LOG("unmapnotify win=%lu", ev->window);
+	DEBUG("unmapnotify win=%lu", ev->window);
 	if (!wintoclient(ev->window, &c, &desktop)) return;
+	if (!ev->send_event && c->pending_unmaps > 0) {
+		--c->pending_unmaps;
+		return;
+	}
 	if (c->ignore_unmaps) return;
-	remove_client(c, desktop);
-	tile();
+
+	// withdrawn: ICCCM clients wait for WithdrawnState before reusing the window,
+	// pagers must not keep it on its desktop nor hidden
+	expect_error();
+	setwmstate(c, WithdrawnState);
+	expect_error();
+	XDeleteProperty(dis, c->win, netatoms[NET_WM_STATE]);
+	expect_error();
+	XDeleteProperty(dis, c->win, netatoms[NET_WM_DESKTOP]);
+	remove_client(c);
+	dirty |= DIRTY_LAYOUT;
 }
 
 void keypress(XEvent *e)
 {
-	int i;
-	XKeyEvent ke = e->xkey;
-	KeySym keysym = XKeycodeToKeysym(dis, ke.keycode, 0);
-	int state = ke.state & ~ignored_modifiers_mask;
+	XKeyEvent *ev = &e->xkey;
+	unsigned int state = ev->state & ~ignored_modifiers_mask;
 
-	for (i = 0; i < TABLENGTH(keys); ++i) {
-		if (keys[i].keysym == keysym && keys[i].mod == state) {
-			keys[i].function(&(keys[i].arg));
-		}
+	if (keytable == NULL || state > 0xff) return;
+	for (int i = keytable[ev->keycode * modcolumns + modindex[state]]; i != 0; i = keynext[i - 1]) {
+		keys[i - 1].function(&(keys[i - 1].arg));
 	}
 }
 
-void maprequest(XEvent *e)
+void mappingnotify(XEvent *e)
 {
-	XMapRequestEvent *ev = &e->xmaprequest;
-	LOG("maprequest win=%lu", ev->window);
+	XMappingEvent *ev = &e->xmapping;
 
-	XSetWindowBorderWidth(dis, ev->window, BORDER);
-	XMapWindow(dis, ev->window);
+	XRefreshKeyboardMapping(ev);
+	if (ev->request == MappingKeyboard || ev->request == MappingModifier) {
+		LOG("keyboard mapping changed, regrab keys");
+		grabkeys();
+	}
+}
 
-	XWindowAttributes attrs = {0};
-	XGetWindowAttributes(dis, ev->window, &attrs);
+#ifdef XINPUT2
+void enternotify(XEvent *e)
+{
+	pointer_win = e->xcrossing.window;
+}
+
+void genericevent(XEvent *e)
+{
+	XGenericEventCookie *cookie = &e->xcookie;
+
+	if (!have_xi || cookie->extension != xi_opcode || !XGetEventData(dis, cookie)) return;
+	if (cookie->evtype == XI_RawButtonPress && pointer_win != None) {
+		// raw events have no window, the press goes to the one the pointer entered last
+		XIRawEvent *raw = cookie->data;
+		XEvent press = { .xbutton = {
+			.type = ButtonPress,
+			.display = dis,
+			.window = pointer_win,
+			.root = root,
+			.button = raw->detail,
+		}};
+		buttonpress(&press);
+	}
+	XFreeEventData(dis, cookie);
+}
+
+void leavenotify(XEvent *e)
+{
+	XCrossingEvent *ev = &e->xcrossing;
+
+	// moving into a child window is not leaving
+	if (ev->detail != NotifyInferior && pointer_win == ev->window) pointer_win = None;
+}
+#endif
 
-	if (wintoclient(ev->window, NULL, NULL) || attrs.override_redirect) {
+void maprequest(XEvent *e)
+{
+	XMapRequestEvent *ev = &e->xmaprequest;
+	DEBUG("maprequest win=%lu", ev->window);
+
+	Client *managed;
+	if (wintoclient(ev->window, &managed, NULL)) {
+		// windows of hidden desktops are mapped when the desktop is shown
+		if (!managed->hidden) XMapWindow(dis, ev->window);
 		return;
 	}
 
-	// FIXME: realise getatomprop(Client *c, Atom prop) and
-	// if getatomprop(c, netatom[NetWMState]) == NetWMFullscreen we set it to be fullscreen
-	Client c = { .win = ev->window };
-	XClassHint cls = {0, 0};
-	if (XGetClassHint(dis, c.win, &cls)) {
-		for (int i = 0; i < TABLENGTH(rules); i++) {
-			if (strstr(cls.res_class, rules[i].class) || strstr(cls.res_name, rules[i].class)) {
-				c.isfloat = rules[i].isfloat;
-				c.isfull = rules[i].isfull;
-				c.force_full = rules[i].isfull;
-				c.ignore_unmaps = rules[i].ignore_unmaps;
-				break;
-			}
+	XSetWindowBorderWidth(dis, ev->window, BORDER);
+
+	WinInfo info;
+	getinfo(ev->window, &info);
+	if (info.override_redirect) return;
+
+	// the window is mapped by tile() in the next flush, once it has its final geometry
+	Client c = { .win = ev->window, .hidden = 1, .gx = info.x, .gy = info.y, .gw = info.w, .gh = info.h, .gbw = BORDER,
+	             .published_state = -1 };
+	c.hints = info.hints;
+#ifdef XSYNC
+	// EWMH only allows sync requests to windows that list the protocol
+	if (have_sync && info.sync_request) c.counter = info.counter;
+#endif
+	XSetWindowBorder(dis, c.win, win_unfocus);
+	// size hints are refreshed on PropertyNotify
+	long mask = PropertyChangeMask;
+#ifdef XINPUT2
+	// clicks are seen on the root window, only the window under the pointer is tracked
+	if (have_xi) {
+		mask |= EnterWindowMask | LeaveWindowMask;
+	} else {
+		grabbuttons(c.win);
+	}
+#else
+	grabbuttons(c.win);
+#endif
+	XSelectInput(dis, c.win, mask);
+	for (int i = 0; i < TABLENGTH(rules); i++) {
+		if (strstr(info.class, rules[i].class) || strstr(info.instance, rules[i].class)) {
+			c.isfloat = rules[i].isfloat;
+			c.isfull = rules[i].isfull;
+			c.force_full = rules[i].isfull;
+			c.ignore_unmaps = rules[i].ignore_unmaps;
+			break;
 		}
 	}
 
-	if (getprop(c.win, netatoms[NET_WM_STATE]) == netatoms[NET_FULLSCREEN]) {
-		c.isfull = 1;
+	// the states nuwm manages are rewritten by setnetstate(), the others are kept
+	for (int i = 0; i < info.nstates; ++i) {
+		if (info.states[i] == netatoms[NET_FULLSCREEN]) {
+			c.isfull = 1;
+		} else if (info.states[i] == netatoms[NET_DEMANDS_ATTENTION]) {
+			c.urgent = 1;
+		} else if (info.states[i] != netatoms[NET_HIDDEN]) {
+			c.states[c.nstates++] = info.states[i];
+		}
 	}
 
-	if (cls.res_class) XFree(cls.res_class);
-	if (cls.res_name) XFree(cls.res_name);
 	if (c.isfull) {
 		setfullscreen(&c, 1);
 	} else if (c.isfloat) {
-		c.x = attrs.x;
-		c.y = attrs.y;
-		c.w = attrs.width;
-		c.h = attrs.height;
+		c.x = info.x;
+		c.y = info.y;
+		c.w = info.w;
+		c.h = info.h;
 	}
 
-	copy_client(&c, current_desktop);
+	Client *new = alloc_client();
+	*new = c;
+	index_add(new);
+	attach_client(new, current_desktop);
 
-	tile();
-	write_info();
+	dirty |= DIRTY_LAYOUT | DIRTY_STATUS;
 }
 
-// Implementation of private functions
-void copy_client(Client *c, int desktop)
+void motionnotify(XEvent *e)
 {
-	Client *new = calloc(sizeof(*c), 1);
-	*new = *c;
-	LOG("copy client client=%p -> desktop=%d, new client=%p", (void *) c, desktop, (void *) new);
+	// only the latest position matters, skip the motions right behind it but never
+	// past another event, a release must not be followed by an older position
+	XEvent next;
+	while (XEventsQueued(dis, QueuedAfterReading) > 0) {
+		XPeekEvent(dis, &next);
+		if (next.type != MotionNotify || next.xmotion.window != e->xmotion.window) break;
+		XNextEvent(dis, e);
+	}
 
-	Client *current = desktops[desktop].current;
-	if (current == NULL) {
-		new->next = desktops[desktop].head;
-		desktops[desktop].head = new;
-	} else if (current == desktops[desktop].head) {
-		new->next = current;
-		desktops[desktop].head = new;
-	} else {
-		Client *prev = desktops[desktop].head;
-		for (; prev->next != current && prev->next != NULL; prev = prev->next);
-		if (prev->next == NULL) die("something wrong with clients list");
-		prev->next = new;
-		new->next = current;
+	if (drag.client == NULL) return;
+	drag.pointer_x = e->xmotion.x_root;
+	drag.pointer_y = e->xmotion.y_root;
+	drag.moved = 1;
+}
+
+void propertynotify(XEvent *e)
+{
+	XPropertyEvent *ev = &e->xproperty;
+	Client *c;
+	int desktop;
+
+	if (wintoclient(ev->window, &c, &desktop)) {
+		if (ev->atom == XA_WM_NORMAL_HINTS) {
+			gethints(c->win, &c->hints);
+			if (desktops[desktop].monitor >= 0) dirty |= DIRTY_LAYOUT;
+		}
+	}
+}
+
+// Implementation of private functions
+Client *alloc_client(void)
+{
+	if (free_clients == NULL) {
+		Pool *pool = calloc(1, sizeof(Pool));
+		if (pool == NULL) die("cannot allocate clients");
+		pool->next = pools;
+		pools = pool;
+		for (int i = POOL_CHUNK - 1; i >= 0; --i) {
+			pool->clients[i].next = free_clients;
+			free_clients = &pool->clients[i];
+		}
 	}
 
-	desktops[desktop].current = new;
+	Client *c = free_clients;
+	free_clients = c->next;
+	memset(c, 0, sizeof(*c));
+	return c;
+}
+
+void apply_hints(Client *c, int *w, int *h)
+{
+	// see ICCCM 4.1.2.3, base and minimum size stand in for each other
+	SizeHints *s = &c->hints;
+	int basew = s->basew ? s->basew : s->minw, baseh = s->baseh ? s->baseh : s->minh;
+	int minw = s->minw ? s->minw : s->basew, minh = s->minh ? s->minh : s->baseh;
+
+	if (s->incw > 0) *w -= (*w - basew) % s->incw;
+	if (s->inch > 0) *h -= (*h - baseh) % s->inch;
+	*w = MAX(*w, minw);
+	*h = MAX(*h, minh);
+	if (s->maxw > 0) *w = MIN(*w, s->maxw);
+	if (s->maxh > 0) *h = MIN(*h, s->maxh);
+	*w = MAX(*w, 1);
+	*h = MAX(*h, 1);
+}
+
+void attach_client(Client *c, int desktop)
+{
+	DEBUG("attach client=%p win=%lu desktop=%d", (void *) c, c->win, desktop);
+
+	// new clients go before the current one and become current
+	c->desktop = desktop;
+	link_client(&desktops[desktop], c, desktops[desktop].current);
+	desktops[desktop].current = c;
 }
 
 void cleanup()
@@ -549,43 +1162,86 @@ void cleanup()
 
 	XDestroyWindow(dis, wmcheckwin);
 	XUngrabKey(dis, AnyKey, AnyModifier, root);
-	XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
-	for (int i = 0; i < nchildren; ++i) send_kill_signal(children[i]);
-	if (children) XFree(children);
-	XSync(dis, False);
 
-	XEvent ev;
-	int attempts = 5;
-	while (nchildren > 0 && attempts > 0) {
+	// only the quit command closes the session, SIGTERM and SIGHUP just stop nuwm
+	if (!keep_clients) {
 		XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
+		for (int i = 0; i < nchildren; ++i) send_kill_signal(children[i]);
+		if (children) XFree(children);
+		XSync(dis, False);
 
-		if (attempts == 2) {
-			for (int i = 0; i < nchildren; ++i) XDestroyWindow(dis, children[i]);
-			XSync(dis, False);
+		XEvent ev;
+		int attempts = 5;
+		while (nchildren > 0 && attempts > 0) {
+			XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
+
+			if (attempts == 2) {
+				for (int i = 0; i < nchildren; ++i) XDestroyWindow(dis, children[i]);
+				XSync(dis, False);
+			}
+
+			if (children) XFree(children);
+			if (XPending(dis) > 0) {
+				XNextEvent(dis, &ev);
+			}
+			sleep(1);
+			--attempts;
 		}
 
-		if (children) XFree(children);
-		if (XPending(dis) > 0) {
-			XNextEvent(dis, &ev);
+		XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
+		for (int i = 0; i < nchildren; ++i) XKillClient(dis, children[i]);
+		XFree(children);
+	} else {
+		// windows of the other desktops must not stay unmapped or off the screen after nuwm
+		for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+			for (Client *c = desktops[i].head; c != NULL; c = c->next) {
+				if (!c->hidden) continue;
+				if (c->isfloat) {
+					XMoveWindow(dis, c->win, c->x, c->y);
+				} else {
+					XMoveWindow(dis, c->win, monitors[selmon].x, monitors[selmon].y + BAR);
+				}
+				show_client(c);
+			}
 		}
-		sleep(1);
-		--attempts;
+		XSync(dis, False);
 	}
-
-	XQueryTree(dis, root, &root_return, &parent, &children, &nchildren);
-	for (int i = 0; i < nchildren; ++i) XKillClient(dis, children[i]);
-	XFree(children);
 	XCloseDisplay(dis);
 
-	for (int i = 0; i < DESKTOPS_SIZE; ++i) {
-		Client *c = desktops[i].head;
-		Client *next = c->next;
-		while (c != NULL) {
-			free(c);
-			c = next;
-			next = c->next;
+	if (ipc_fd >= 0) {
+		for (int i = 0; i < IPC_CLIENTS; ++i) {
+			if (ipc_clients[i].fd >= 0) ipc_close(&ipc_clients[i]);
 		}
+		close(ipc_fd);
+		unlink(ipc_path);
+	}
+	if (snapshot != NULL) {
+		munmap(snapshot, sizeof(Snapshot));
+		unlink(snapshot_path);
 	}
+
+	while (pools != NULL) {
+		Pool *next = pools->next;
+		free(pools);
+		pools = next;
+	}
+}
+
+Monitor *desktop_monitor(int desktop)
+{
+	// hidden desktops and clients not attached yet go to the selected monitor
+	int m = desktop > 0 && desktop < DESKTOPS_SIZE ? desktops[desktop].monitor : -1;
+	return &monitors[m >= 0 ? m : selmon];
+}
+
+void detach_client(Client *c)
+{
+	Desktop *d = &desktops[c->desktop];
+
+	DEBUG("detach client=%p win=%lu desktop=%d", (void *) c, c->win, c->desktop);
+	if (d->current == c) d->current = c->next;
+	unlink_client(d, c);
+	if (d->current == NULL) d->current = d->head;
 }
 
 void die(const char *e)
@@ -594,134 +1250,1013 @@ void die(const char *e)
 	exit(1);
 }
 
-unsigned long getcolor(const char *color)
+unsigned long long drag_update(void)
 {
-	XColor c;
-	Colormap map = DefaultColormap(dis, screen);
+	Client *c = drag.client;
+	if (c == NULL || !drag.moved) return 0;
+	if (c->hidden || !c->isfloat) {
+		drag.client = NULL;
+		return 0;
+	}
 
-	if (!XAllocNamedColor(dis, map, color, &c, &c)) die("error parsing color");
+	// the pointer moves much faster than the screen refreshes
+	unsigned long long t = now(), next = drag.applied_at + 1000000000ULL / DRAG_HZ;
+	if (t < next) return next;
 
-	return c.pixel;
+	int dx = drag.pointer_x - drag.start_x, dy = drag.pointer_y - drag.start_y;
+	if (drag.button == MOVE_BUTTON) {
+		move_resize_floating(c, drag.x + dx, drag.y + dy, drag.w, drag.h);
+	} else {
+		move_resize_floating(c, drag.x, drag.y, drag.w + dx, drag.h + dy);
+	}
+	drag.moved = 0;
+	drag.applied_at = t;
+	return 0;
 }
 
-Atom getprop(Window win, Atom prop)
+void dump_stat(const char *name, Stat *s)
 {
-	int di;
-	unsigned long dl;
-	unsigned char *p = NULL;
-	Atom da, atom = None;
+	char hist[HIST_SIZE * 24] = {0};
+	int length = 0;
 
-	if (XGetWindowProperty(dis, win, prop, 0L, sizeof(atom), False, XA_ATOM,
-		                   &da, &di, &dl, &dl, &p) == Success && p) {
-		atom = *(Atom *)p;
-		XFree(p);
+	if (s->count == 0) return;
+	for (int i = 0; i < HIST_SIZE; ++i) {
+		if (s->hist[i] == 0) continue;
+		if (i < HIST_SIZE - 1) {
+			length += snprintf(hist + length, sizeof(hist) - length, " <%luus:%lu", 1UL << i, s->hist[i]);
+		} else {
+			length += snprintf(hist + length, sizeof(hist) - length, " >=%luus:%lu", 1UL << (i - 1), s->hist[i]);
+		}
 	}
-	return atom;
+	fprintf(stderr, "stat %s: count=%lu avg=%lluns requests=%lu roundtrips=%lu%s\n", name, s->count,
+	        s->total / s->count, s->requests, s->roundtrips, hist);
 }
 
-void grabkeys()
+void dump_stats(void)
 {
-	KeyCode code;
-
-	unsigned int ignored_modifiers_num = TABLENGTH(ignored_modifiers);
-	for (int i = 0; i < (1 << ignored_modifiers_num); ++i) {
-		unsigned int mask = 0;
-		for (int j = 0; j < ignored_modifiers_num; ++j) {
-			if (i & (1 << j)) {
-				mask |= ignored_modifiers[j];
-			}
-		}
+	static const char *event_names[LASTEvent] = {
+		[ButtonPress]      = "buttonpress",
+		[ButtonRelease]    = "buttonrelease",
+		[MotionNotify]     = "motionnotify",
+		[ClientMessage]    = "clientmessage",
+		[ConfigureNotify]  = "configurenotify",
+		[ConfigureRequest] = "configurerequest",
+		[DestroyNotify]    = "destroynotify",
+		[UnmapNotify]      = "unmapnotify",
+		[KeyPress]         = "keypress",
+		[MapRequest]       = "maprequest",
+		[MappingNotify]    = "mappingnotify",
+		[PropertyNotify]   = "propertynotify",
+		[EnterNotify]      = "enternotify",
+		[GenericEvent]     = "genericevent",
+		[LeaveNotify]      = "leavenotify",
+	};
+	char name[16];
 
-		for (int k = 0; k < TABLENGTH(keys); ++k) {
-			if ((code = XKeysymToKeycode(dis, keys[k].keysym))) {
-				XGrabKey(dis, code, keys[k].mod | mask, root, True, GrabModeAsync, GrabModeAsync);
-			}
-		}
+	LOG("latency stats, requests = %lu, roundtrips = %lu", NextRequest(dis) - 1, roundtrips);
+	for (int i = 0; i < LASTEvent; ++i) {
+		snprintf(name, sizeof(name), "event%d", i);
+		dump_stat(event_names[i] ? event_names[i] : name, &event_stats[i]);
 	}
-
-	ignored_modifiers_mask = 0;
-	for (int i = 0; i < ignored_modifiers_num; ++i) {
-		ignored_modifiers_mask |= ignored_modifiers[i];
+	for (int i = 0; i < STAT_COUNT; ++i) {
+		dump_stat(action_names[i], &action_stats[i]);
 	}
 }
 
-void move_resize_floating(Client *c, int x, int y, int w, int h)
+void dump_trace(void)
 {
-	w = MAX(10, MIN(w, sw - 2*BORDER));
-	h = MAX(10, MIN(h, sh - 2*BORDER - BAR));
-	x = MAX(0, x);
-	y = MAX(BAR, y);
-
-	int corner_x = x + w + 2*BORDER;
-	int corner_y = y + h + 2*BORDER;
-
-	if (corner_x > sw) x -= (corner_x - sw);
-	if (corner_y > sh) y -= (corner_y - sh);
+	unsigned long long first = ntraces > TRACE_SIZE ? ntraces - TRACE_SIZE : 0;
 
-	c->x = x;
-	c->y = y;
-	c->w = w;
-	c->h = h;
-	XMoveResizeWindow(dis, c->win, x, y, w, h);
+	LOG("trace: %llu records, showing last %llu", ntraces, ntraces - first);
+	for (unsigned long long i = first; i < ntraces; ++i) {
+		Trace *t = &traces[i & (TRACE_SIZE - 1)];
+		fprintf(stderr, "trace %llu.%09llu type=%d win=%lu duration=%uns\n",
+		        t->time / 1000000000ULL, t->time % 1000000000ULL, t->type, t->win, t->duration);
+	}
 }
 
-void remove_client(Client *c, int desktop)
+void expect_error(void)
 {
-	LOG("remove client=%p win=%lu desktop=%d", (void *) c, c->win, desktop);
-	if (c == NULL) return;
+	ignored_serials[ignored_serials_pos] = NextRequest(dis);
+	ignored_serials_pos = (ignored_serials_pos + 1) % IGNORED_SERIALS;
+}
 
-	Client *head = desktops[desktop].head;
-	if (head == c) {
-		desktops[desktop].head = head->next;
-	} else {
-		Client *prev = desktops[desktop].head;
-		for (; prev->next != c && prev->next != NULL; prev = prev->next);
-		if (prev->next == NULL) die("something wrong with clients list");
-		prev->next = c->next;
+void flush(void)
+{
+	if (!dirty) return;
+	++nbatches;
+
+	unsigned int stages = dirty;
+	dirty = 0;
+
+	Probe flush_probe, probe;
+	probe_start(&flush_probe);
+	if (stages & DIRTY_DESKTOP) {
+		// desktops that are not on a monitor any more, new ones are shown by tile()
+		probe_start(&probe);
+		for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+			if (desktops[i].shown && desktops[i].monitor < 0) hide_desktop(i);
+			desktops[i].shown = (desktops[i].monitor >= 0);
+		}
+		probe_stop(&probe, &action_stats[STAT_CHANGE_DESKTOP]);
 	}
-	if (desktops[desktop].current == c) {
-		desktops[desktop].current = c->next;
-		if (desktops[desktop].current == NULL) desktops[desktop].current = desktops[desktop].head;
+	if (stages & DIRTY_LAYOUT) {
+		probe_start(&probe);
+		tile();
+		probe_stop(&probe, &action_stats[STAT_TILE]);
 	}
-
-	free(c);
-	write_info();
+	if (stages & (DIRTY_LAYOUT | DIRTY_FOCUS)) {
+		probe_start(&probe);
+		update_focus();
+		probe_stop(&probe, &action_stats[STAT_UPDATE_FOCUS]);
+	}
+	if (stages & DIRTY_STATUS) {
+		probe_start(&probe);
+		write_info();
+		probe_stop(&probe, &action_stats[STAT_WRITE_INFO]);
+	}
+	if (stages & (DIRTY_LAYOUT | DIRTY_FOCUS | DIRTY_STATUS)) write_stacking();
+	if (stages & (DIRTY_STATUS | DIRTY_FOCUS | DIRTY_LAYOUT)) {
+		ipc_publish(NULL);
+		snapshot_write();
+	}
+	probe_stop(&flush_probe, &action_stats[STAT_FLUSH]);
 }
 
-void send_kill_signal(Window w)
+unsigned long getcolor(const char *color)
 {
-	XEvent ke;
-	ke.type = ClientMessage;
-	ke.xclient.window = w;
-	ke.xclient.format = 32;
-	ke.xclient.message_type = wmatoms[WM_PROTOCOLS];
-	ke.xclient.data.l[0] = wmatoms[WM_DELETE_WINDOW];
-	ke.xclient.data.l[1] = CurrentTime;
-	XSendEvent(dis, w, False, NoEventMask, &ke);
+	XColor c;
+	Colormap map = DefaultColormap(dis, screen);
+
+	if (!XAllocNamedColor(dis, map, color, &c, &c)) die("error parsing color");
+
+	return c.pixel;
 }
 
-void setfullscreen(Client *c, int fullscreen)
+#ifdef XCB
+void getinfo(Window win, WinInfo *info)
 {
-	if (fullscreen != c->isfull)
-		XChangeProperty(dis, c->win, netatoms[NET_WM_STATE], XA_ATOM, 32, PropModeReplace,
-		                (unsigned char*)(fullscreen ? &netatoms[NET_FULLSCREEN] : 0), fullscreen);
-	if (fullscreen) {
-		c->isfull = c->isfloat = 1;
-		c->x = c->y = 0;
-		c->w = sw;
-		c->h = sh;
-		XMoveResizeWindow(dis, c->win, 0, 0, sw, sh);
-		XSetWindowBorderWidth(dis, c->win, 0);
-	} else {
-		c->isfull = c->isfloat = 0;
-		tile();
+	xcb_generic_error_t *err;
+	memset(info, 0, sizeof(*info));
+
+	// send all requests first, then wait for the replies: one round trip
+	xcb_get_window_attributes_cookie_t attrs_cookie = xcb_get_window_attributes(xcb, win);
+	xcb_get_geometry_cookie_t geom_cookie = xcb_get_geometry(xcb, win);
+	xcb_get_property_cookie_t class_cookie = xcb_get_property(xcb, 0, win, XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, 0, 128);
+	xcb_get_property_cookie_t state_cookie = xcb_get_property(xcb, 0, win, netatoms[NET_WM_STATE], XCB_ATOM_ATOM, 0, MAX_STATES);
+	xcb_get_property_cookie_t hints_cookie = xcb_get_property(xcb, 0, win, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS, 0, 18);
+	xcb_get_property_cookie_t counter_cookie = xcb_get_property(xcb, 0, win, netatoms[NET_SYNC_COUNTER], XCB_ATOM_CARDINAL, 0, 1);
+	xcb_get_property_cookie_t protocols_cookie = xcb_get_property(xcb, 0, win, wmatoms[WM_PROTOCOLS], XCB_ATOM_ATOM, 0, 32);
+	ROUNDTRIP();
+
+	xcb_get_window_attributes_reply_t *attrs = xcb_get_window_attributes_reply(xcb, attrs_cookie, &err);
+	if (attrs != NULL) info->override_redirect = attrs->override_redirect;
+	free(attrs);
+	free(err);
+
+	xcb_get_geometry_reply_t *geom = xcb_get_geometry_reply(xcb, geom_cookie, &err);
+	if (geom != NULL) {
+		info->x = geom->x;
+		info->y = geom->y;
+		info->w = geom->width;
+		info->h = geom->height;
 	}
+	free(geom);
+	free(err);
+
+	readclass(class_cookie, info);
+	readstate(state_cookie, info);
+	readhints(hints_cookie, &info->hints);
+	readcounter(counter_cookie, info);
+	readprotocols(protocols_cookie, info);
 }
 
-void setup()
+void gethints(Window win, SizeHints *hints)
 {
-	LOG("setup started");
-	if ((dis = XOpenDisplay(NULL)) == NULL) die("cannot open display");
+	ROUNDTRIP();
+	readhints(xcb_get_property(xcb, 0, win, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS, 0, 18), hints);
+}
+
+void readclass(xcb_get_property_cookie_t cookie, WinInfo *info)
+{
+	xcb_generic_error_t *err;
+
+	info->class[0] = info->instance[0] = '\0';
+
+	// WM_CLASS is the instance and the class, each terminated by a null byte
+	xcb_get_property_reply_t *class = xcb_get_property_reply(xcb, cookie, &err);
+	if (class != NULL) {
+		const char *value = xcb_get_property_value(class);
+		int length = xcb_get_property_value_length(class);
+		int instance_length = strnlen(value, length);
+		snprintf(info->instance, sizeof(info->instance), "%.*s", instance_length, value);
+		if (instance_length + 1 < length) {
+			snprintf(info->class, sizeof(info->class), "%.*s", length - instance_length - 1, value + instance_length + 1);
+		}
+	}
+	free(class);
+	free(err);
+}
+
+void readcounter(xcb_get_property_cookie_t cookie, WinInfo *info)
+{
+	xcb_generic_error_t *err;
+
+	info->counter = None;
+	xcb_get_property_reply_t *counter = xcb_get_property_reply(xcb, cookie, &err);
+	if (counter != NULL && xcb_get_property_value_length(counter) >= sizeof(uint32_t)) {
+		info->counter = *(uint32_t *) xcb_get_property_value(counter);
+	}
+	free(counter);
+	free(err);
+}
+
+void readhints(xcb_get_property_cookie_t cookie, SizeHints *hints)
+{
+	xcb_generic_error_t *err;
+
+	memset(hints, 0, sizeof(*hints));
+
+	// WM_SIZE_HINTS: flags, x, y, w, h, min, max, increments, aspects, base, gravity
+	xcb_get_property_reply_t *reply = xcb_get_property_reply(xcb, cookie, &err);
+	if (reply != NULL && reply->format == 32) {
+		const uint32_t *v = xcb_get_property_value(reply);
+		int n = xcb_get_property_value_length(reply) / 4;
+		uint32_t flags = n > 0 ? v[0] : 0;
+		if ((flags & PMinSize) && n > 6) {
+			hints->minw = v[5];
+			hints->minh = v[6];
+		}
+		if ((flags & PMaxSize) && n > 8) {
+			hints->maxw = v[7];
+			hints->maxh = v[8];
+		}
+		if ((flags & PResizeInc) && n > 10) {
+			hints->incw = v[9];
+			hints->inch = v[10];
+		}
+		if ((flags & PBaseSize) && n > 16) {
+			hints->basew = v[15];
+			hints->baseh = v[16];
+		}
+	}
+	free(reply);
+	free(err);
+}
+
+void readprotocols(xcb_get_property_cookie_t cookie, WinInfo *info)
+{
+	xcb_generic_error_t *err;
+
+	info->sync_request = 0;
+	xcb_get_property_reply_t *protocols = xcb_get_property_reply(xcb, cookie, &err);
+	if (protocols != NULL) {
+		const xcb_atom_t *atoms = xcb_get_property_value(protocols);
+		int n = xcb_get_property_value_length(protocols) / sizeof(xcb_atom_t);
+		for (int i = 0; i < n; ++i) {
+			if (atoms[i] == netatoms[NET_SYNC_REQUEST]) info->sync_request = 1;
+		}
+	}
+	free(protocols);
+	free(err);
+}
+
+void readstate(xcb_get_property_cookie_t cookie, WinInfo *info)
+{
+	xcb_generic_error_t *err;
+
+	info->nstates = 0;
+	xcb_get_property_reply_t *state = xcb_get_property_reply(xcb, cookie, &err);
+	if (state != NULL) {
+		const xcb_atom_t *atoms = xcb_get_property_value(state);
+		int n = MIN(xcb_get_property_value_length(state) / (int) sizeof(xcb_atom_t), MAX_STATES);
+		for (; info->nstates < n; ++info->nstates) info->states[info->nstates] = atoms[info->nstates];
+	}
+	free(state);
+	free(err);
+}
+#else
+void getinfo(Window win, WinInfo *info)
+{
+	XWindowAttributes attrs = {0};
+	memset(info, 0, sizeof(*info));
+
+	if (XGetWindowAttributes(dis, win, &attrs)) {
+		info->override_redirect = attrs.override_redirect;
+		info->x = attrs.x;
+		info->y = attrs.y;
+		info->w = attrs.width;
+		info->h = attrs.height;
+	}
+
+	readclass(win, info);
+	readstate(win, info);
+	gethints(win, &info->hints);
+	info->counter = getprop(win, netatoms[NET_SYNC_COUNTER], XA_CARDINAL);
+	readprotocols(win, info);
+}
+
+void gethints(Window win, SizeHints *hints)
+{
+	XSizeHints size;
+	long supplied;
+
+	memset(hints, 0, sizeof(*hints));
+	if (!XGetWMNormalHints(dis, win, &size, &supplied)) return;
+	if (size.flags & PMinSize) {
+		hints->minw = size.min_width;
+		hints->minh = size.min_height;
+	}
+	if (size.flags & PMaxSize) {
+		hints->maxw = size.max_width;
+		hints->maxh = size.max_height;
+	}
+	if (size.flags & PResizeInc) {
+		hints->incw = size.width_inc;
+		hints->inch = size.height_inc;
+	}
+	if (size.flags & PBaseSize) {
+		hints->basew = size.base_width;
+		hints->baseh = size.base_height;
+	}
+}
+
+Atom getprop(Window win, Atom prop, Atom type)
+{
+	int di;
+	unsigned long dl;
+	unsigned char *p = NULL;
+	Atom da, atom = None;
+
+	if (XGetWindowProperty(dis, win, prop, 0L, 1L, False, type,
+		                   &da, &di, &dl, &dl, &p) == Success && p) {
+		atom = *(Atom *)p;
+		XFree(p);
+	}
+	return atom;
+}
+
+void readclass(Window win, WinInfo *info)
+{
+	XClassHint cls = {0, 0};
+
+	info->class[0] = info->instance[0] = '\0';
+	if (XGetClassHint(dis, win, &cls)) {
+		if (cls.res_class) snprintf(info->class, sizeof(info->class), "%s", cls.res_class);
+		if (cls.res_name) snprintf(info->instance, sizeof(info->instance), "%s", cls.res_name);
+	}
+	if (cls.res_class) XFree(cls.res_class);
+	if (cls.res_name) XFree(cls.res_name);
+}
+
+void readprotocols(Window win, WinInfo *info)
+{
+	Atom *protocols;
+	int n;
+
+	info->sync_request = 0;
+	if (!XGetWMProtocols(dis, win, &protocols, &n)) return;
+	for (int i = 0; i < n; ++i) {
+		if (protocols[i] == netatoms[NET_SYNC_REQUEST]) info->sync_request = 1;
+	}
+	XFree(protocols);
+}
+
+void readstate(Window win, WinInfo *info)
+{
+	int di;
+	unsigned long n, dl;
+	unsigned char *p = NULL;
+	Atom da;
+
+	info->nstates = 0;
+	if (XGetWindowProperty(dis, win, netatoms[NET_WM_STATE], 0L, MAX_STATES, False, XA_ATOM,
+		                   &da, &di, &n, &dl, &p) == Success && p) {
+		for (; info->nstates < n; ++info->nstates) info->states[info->nstates] = ((Atom *) p)[info->nstates];
+		XFree(p);
+	}
+}
+#endif
+
+void grabbuttons(Window win)
+{
+	XGrabButton(dis, AnyButton, AnyModifier, win, False, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+}
+
+void grabdrag(void)
+{
+	unsigned int ignored_modifiers_num = TABLENGTH(ignored_modifiers);
+	for (int i = 0; i < (1 << ignored_modifiers_num); ++i) {
+		unsigned int mask = 0;
+		for (int j = 0; j < ignored_modifiers_num; ++j) {
+			if (i & (1 << j)) {
+				mask |= ignored_modifiers[j];
+			}
+		}
+
+		// grabs of the root window win over the ones of the clients, focused or not
+		XGrabButton(dis, MOVE_BUTTON, MOD | mask, root, False, DRAG_MASK, GrabModeAsync, GrabModeAsync, None, None);
+		XGrabButton(dis, RESIZE_BUTTON, MOD | mask, root, False, DRAG_MASK, GrabModeAsync, GrabModeAsync, None, None);
+	}
+}
+
+void grabkey(KeyCode code, unsigned int mod, int grab)
+{
+	unsigned int ignored_modifiers_num = TABLENGTH(ignored_modifiers);
+	for (int i = 0; i < (1 << ignored_modifiers_num); ++i) {
+		unsigned int mask = 0;
+		for (int j = 0; j < ignored_modifiers_num; ++j) {
+			if (i & (1 << j)) {
+				mask |= ignored_modifiers[j];
+			}
+		}
+
+		if (grab) {
+			XGrabKey(dis, code, mod | mask, root, True, GrabModeAsync, GrabModeAsync);
+		} else {
+			XUngrabKey(dis, code, mod | mask, root);
+		}
+	}
+}
+
+void grabkeys()
+{
+	KeyCode codes[TABLENGTH(keys)];
+	unsigned char ungrabbed[256] = {0};
+
+	if (keytable == NULL) {
+		ignored_modifiers_mask = 0;
+		for (int i = 0; i < TABLENGTH(ignored_modifiers); ++i) {
+			ignored_modifiers_mask |= ignored_modifiers[i];
+		}
+
+		// modifier states without ignored modifiers are packed into dense columns
+		int bits = 0;
+		for (unsigned int m = 1; m <= Mod5Mask; m <<= 1) {
+			if (ignored_modifiers_mask & m) continue;
+			for (unsigned int state = 0; state < 256; ++state) {
+				if (state & m) modindex[state] |= 1 << bits;
+			}
+			++bits;
+		}
+		modcolumns = 1 << bits;
+		keytable = calloc(256 * modcolumns, sizeof(*keytable));
+		if (keytable == NULL) die("cannot allocate key table");
+	}
+
+	// only regrab keys whose keycode has changed since the last call
+	for (int k = 0; k < TABLENGTH(keys); ++k) {
+		codes[k] = XKeysymToKeycode(dis, keys[k].keysym); // reply is cached by Xlib
+		if (keycodes[k] != 0 && keycodes[k] != codes[k]) {
+			grabkey(keycodes[k], keys[k].mod, 0);
+			ungrabbed[keycodes[k]] = 1;
+		}
+	}
+	for (int k = 0; k < TABLENGTH(keys); ++k) {
+		if (codes[k] != 0 && (codes[k] != keycodes[k] || ungrabbed[codes[k]])) {
+			grabkey(codes[k], keys[k].mod, 1);
+		}
+		keycodes[k] = codes[k];
+	}
+
+	memset(keytable, 0, 256 * modcolumns * sizeof(*keytable));
+	for (int k = TABLENGTH(keys) - 1; k >= 0; --k) {
+		if (keycodes[k] == 0) continue;
+		unsigned short *slot = &keytable[keycodes[k] * modcolumns + modindex[keys[k].mod & 0xff]];
+		keynext[k] = *slot;
+		*slot = k + 1;
+	}
+}
+
+void index_add(Client *c)
+{
+	Client **bucket = &winindex[c->win & (INDEX_SIZE - 1)];
+
+	c->hnext = *bucket;
+	*bucket = c;
+}
+
+void index_remove(Client *c)
+{
+	Client **p = &winindex[c->win & (INDEX_SIZE - 1)];
+
+	for (; *p != NULL && *p != c; p = &(*p)->hnext);
+	if (*p == NULL) die("something wrong with window index");
+	*p = c->hnext;
+}
+
+void hide_client(Client *c)
+{
+	if (c->hidden) {
+		++suppressed_requests;
+		return;
+	}
+	// the desktop is placed again when it is shown
+	c->pending = 0;
+	if (HIDE_MODE == HIDE_UNMAP) {
+		++c->pending_unmaps;
+		XUnmapWindow(dis, c->win);
+		c->mapped = 0;
+		// let toolkits know they can stop rendering, ICCCM only allows it for unmapped windows
+		setwmstate(c, IconicState);
+	} else {
+		XMoveWindow(dis, c->win, 0, sh + 5);
+		c->gx = 0;
+		c->gy = sh + 5;
+	}
+	c->hidden = 1;
+	setnetstate(c);
+}
+
+void hide_desktop(int desktop)
+{
+	Client *current = desktops[desktop].current;
+
+	// only the desktop being left has visible windows, the current one goes last
+	for (Client *c = desktops[desktop].head; c != NULL; c = c->next) {
+		if (c != current) hide_client(c);
+	}
+	if (current != NULL) hide_client(current);
+}
+
+void link_client(Desktop *d, Client *c, Client *before)
+{
+	if (before == NULL) {
+		// append to the tail
+		Client *tail = d->head != NULL ? d->head->prev : NULL;
+		c->next = NULL;
+		if (tail != NULL) {
+			tail->next = c;
+			c->prev = tail;
+			d->head->prev = c;
+		} else {
+			d->head = c;
+			c->prev = c;
+		}
+	} else {
+		c->next = before;
+		c->prev = before->prev;
+		if (before == d->head) {
+			d->head = c;
+		} else {
+			before->prev->next = c;
+		}
+		before->prev = c;
+	}
+}
+
+void ipc_close(IpcClient *ic)
+{
+	close(ic->fd);
+	ic->fd = -1;
+}
+
+void ipc_command(IpcClient *ic, char *line)
+{
+	char *name = strtok(line, " \t"), *value = strtok(NULL, " \t"), *end;
+
+	if (name == NULL) return;
+	if (!strcmp(name, "subscribe")) {
+		// the whole state first, then only what changes
+		ic->subscribed = 1;
+		ipc_publish(ic);
+		return;
+	}
+	for (int i = 0; i < TABLENGTH(commands); ++i) {
+		if (strcmp(name, commands[i].name)) continue;
+
+		long n = 0;
+		if (commands[i].has_arg && (value == NULL || (n = strtol(value, &end, 10), *end != '\0'))) {
+			ipc_send(ic, "error missing number\n");
+			return;
+		}
+		if ((commands[i].function == change_desktop || commands[i].function == client_to_desktop)
+		    && (n < 1 || n >= DESKTOPS_SIZE)) {
+			ipc_send(ic, "error no such desktop\n");
+			return;
+		}
+
+		const Arg arg = { .i = n };
+		commands[i].function(&arg);
+		ipc_send(ic, "ok\n");
+		return;
+	}
+	ipc_send(ic, "error unknown command\n");
+}
+
+void ipc_handle(struct pollfd *fds, int nfds)
+{
+	// clients first, accepting may reuse the slot of one closed here
+	for (int k = 1; k < nfds; ++k) {
+		if (!fds[k].revents) continue;
+		IpcClient *ic = NULL;
+		for (int i = 0; i < IPC_CLIENTS; ++i) {
+			if (ipc_clients[i].fd == fds[k].fd) ic = &ipc_clients[i];
+		}
+		if (ic == NULL) continue;
+
+		ssize_t n = read(ic->fd, ic->buf + ic->length, sizeof(ic->buf) - 1 - ic->length);
+		if (n <= 0) {
+			if (n < 0 && errno == EAGAIN) continue;
+			ipc_close(ic);
+			continue;
+		}
+		ic->length += n;
+		ic->buf[ic->length] = '\0';
+
+		char *line = ic->buf, *eol;
+		while (ic->fd >= 0 && (eol = strchr(line, '\n')) != NULL) {
+			*eol = '\0';
+			ipc_command(ic, line);
+			line = eol + 1;
+		}
+		if (ic->fd < 0) continue;
+		ic->length -= line - ic->buf;
+		memmove(ic->buf, line, ic->length);
+		if (ic->length == sizeof(ic->buf) - 1) ipc_close(ic); // no line fits, not a client of ours
+	}
+
+	if (nfds > 0 && (fds[0].revents & POLLIN)) {
+		int fd = accept(ipc_fd, NULL, NULL);
+		if (fd < 0) return;
+		for (int i = 0; i < IPC_CLIENTS; ++i) {
+			if (ipc_clients[i].fd >= 0) continue;
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			ipc_clients[i] = (IpcClient){ .fd = fd };
+			return;
+		}
+		close(fd);
+	}
+}
+
+int ipc_pollfds(struct pollfd *fds)
+{
+	int n = 0;
+
+	if (ipc_fd < 0) return 0;
+	fds[n++] = (struct pollfd){ .fd = ipc_fd, .events = POLLIN };
+	for (int i = 0; i < IPC_CLIENTS; ++i) {
+		if (ipc_clients[i].fd >= 0) fds[n++] = (struct pollfd){ .fd = ipc_clients[i].fd, .events = POLLIN };
+	}
+	return n;
+}
+
+void ipc_publish(IpcClient *to)
+{
+	char events[64 * DESKTOPS_SIZE];
+	int length = 0, subscribers = 0;
+
+	for (int i = 0; i < IPC_CLIENTS; ++i) {
+		if (ipc_clients[i].fd >= 0 && ipc_clients[i].subscribed) ++subscribers;
+	}
+	if (subscribers == 0) return;
+
+	// a new subscriber gets the whole state, the others only what changed since the last push
+	int all = (to != NULL);
+	int nclients[DESKTOPS_SIZE] = {0};
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) ++nclients[i];
+		if (all || desktops[i].mode != ipc_desktops[i].mode || nclients[i] != ipc_desktops[i].nclients) {
+			length += snprintf(events + length, sizeof(events) - length, "desktop %d %s %d\n",
+			                   i, mode_names[desktops[i].mode], nclients[i]);
+		}
+	}
+	if (all || current_desktop != ipc_current) {
+		length += snprintf(events + length, sizeof(events) - length, "current %d\n", current_desktop);
+	}
+	Window win = focused != NULL ? focused->win : None;
+	if (all || win != ipc_focus) {
+		length += snprintf(events + length, sizeof(events) - length, "focus 0x%lx\n", win);
+	}
+	if (length == 0) return;
+
+	if (to != NULL) {
+		ipc_send(to, events);
+		return;
+	}
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		ipc_desktops[i].mode = desktops[i].mode;
+		ipc_desktops[i].nclients = nclients[i];
+	}
+	ipc_current = current_desktop;
+	ipc_focus = win;
+	for (int i = 0; i < IPC_CLIENTS; ++i) {
+		if (ipc_clients[i].fd >= 0 && ipc_clients[i].subscribed) ipc_send(&ipc_clients[i], events);
+	}
+}
+
+void ipc_send(IpcClient *ic, const char *message)
+{
+	// clients too slow to read a few lines are dropped rather than waited for
+	size_t length = strlen(message);
+	if (send(ic->fd, message, length, MSG_NOSIGNAL) != length) ipc_close(ic);
+}
+
+void ipc_setup(void)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+	for (int i = 0; i < IPC_CLIENTS; ++i) ipc_clients[i].fd = -1;
+	runtime_path(ipc_path, sizeof(ipc_path), "sock");
+	memcpy(addr.sun_path, ipc_path, sizeof(ipc_path));
+
+	unlink(ipc_path);
+	// the socket is created with mode 0600 whatever the umask, the commands can kill windows
+	mode_t mask = umask(0177);
+	int bound = (ipc_fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0 && bind(ipc_fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+	umask(mask);
+	if (!bound || listen(ipc_fd, IPC_CLIENTS) < 0) {
+		LOGL(LOG_ERROR, "cannot listen on %s, no IPC", ipc_path);
+		if (ipc_fd >= 0) close(ipc_fd);
+		ipc_fd = -1;
+		return;
+	}
+	fcntl(ipc_fd, F_SETFD, FD_CLOEXEC);
+	fcntl(ipc_fd, F_SETFL, O_NONBLOCK);
+	LOG("IPC socket %s", ipc_path);
+}
+
+void move_resize_floating(Client *c, int x, int y, int w, int h)
+{
+	Monitor *m = desktop_monitor(c->desktop);
+	w = MAX(10, MIN(w, m->w - 2*BORDER));
+	h = MAX(10, MIN(h, m->h - 2*BORDER - BAR));
+	x = MAX(m->x, x);
+	y = MAX(m->y + BAR, y);
+
+	int corner_x = x + w + 2*BORDER;
+	int corner_y = y + h + 2*BORDER;
+
+	if (corner_x > m->x + m->w) x -= (corner_x - m->x - m->w);
+	if (corner_y > m->y + m->h) y -= (corner_y - m->y - m->h);
+
+	c->x = x;
+	c->y = y;
+	c->w = w;
+	c->h = h;
+	place_client(c, x, y, w, h, c->gbw);
+}
+
+unsigned long long now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long pace_deadline(Client *c)
+{
+#ifdef XSYNC
+	// the alarm of the counter tells when the client is done, this is only a timeout
+	if (c->counter != None) return c->sync_deadline;
+#endif
+	return c->resized_at + 1000000000ULL / RESIZE_HZ;
+}
+
+unsigned long long place_pending(void)
+{
+	unsigned long long t = now(), next = 0;
+
+	// only windows of the desktops on a monitor can be pending, hiding drops the rest
+	for (int i = 0; i < nmonitors; ++i) {
+		for (Client *c = desktops[monitors[i].desktop].head; c != NULL; c = c->next) {
+			if (!c->pending) continue;
+			unsigned long long deadline = pace_deadline(c);
+			if (deadline <= t) {
+				c->pending = 0;
+				place_client(c, c->px, c->py, c->pw, c->ph, c->pbw);
+			} else if (next == 0 || deadline < next) {
+				next = deadline;
+			}
+		}
+	}
+	return next;
+}
+
+void probe_start(Probe *p)
+{
+	p->time = now();
+	p->requests = NextRequest(dis);
+	p->roundtrips = roundtrips;
+}
+
+unsigned long long probe_stop(Probe *p, Stat *s)
+{
+	unsigned long long end = now();
+	unsigned long long us = (end - p->time) / 1000;
+	int bucket = 0;
+
+	for (; bucket < HIST_SIZE - 1 && us >= (1ULL << bucket); ++bucket);
+	++s->hist[bucket];
+	++s->count;
+	s->total += end - p->time;
+	s->requests += NextRequest(dis) - p->requests;
+	s->roundtrips += roundtrips - p->roundtrips;
+	return end;
+}
+
+void place_client(Client *c, int x, int y, int w, int h, int bw)
+{
+	if (!c->isfull) apply_hints(c, &w, &h);
+
+	// resizes of visible windows wait until the client has caught up, see place_pending(),
+	// only for clients that tell when they are done and for interactive resizes
+	int resized = (c->gw != w || c->gh != h);
+	int paced = (c == drag.client);
+#ifdef XSYNC
+	paced |= (c->counter != None);
+#endif
+	if (!c->hidden && (c->pending || (resized && paced && pace_deadline(c) > now()))) {
+		c->pending = 1;
+		c->px = x;
+		c->py = y;
+		c->pw = w;
+		c->ph = h;
+		c->pbw = bw;
+		return;
+	}
+	if (resized) {
+		c->resized_at = now();
+#ifdef XSYNC
+		if (c->counter != None) sync_request(c);
+#endif
+	}
+	if (c->gbw != bw) {
+		XSetWindowBorderWidth(dis, c->win, bw);
+		c->gbw = bw;
+	} else {
+		++suppressed_requests;
+	}
+
+	int moved = (c->gx != x || c->gy != y);
+	if (moved && resized) {
+		XMoveResizeWindow(dis, c->win, x, y, w, h);
+	} else if (moved) {
+		XMoveWindow(dis, c->win, x, y);
+	} else if (resized) {
+		XResizeWindow(dis, c->win, w, h);
+	} else {
+		++suppressed_requests;
+	}
+	c->gx = x;
+	c->gy = y;
+	c->gw = w;
+	c->gh = h;
+	if (c->hidden) show_client(c);
+}
+
+void remove_client(Client *c)
+{
+	DEBUG("remove client=%p win=%lu desktop=%d", (void *) c, c->win, c->desktop);
+
+	detach_client(c);
+	index_remove(c);
+	if (focused == c) focused = NULL;
+	if (drag.client == c) drag.client = NULL;
+#ifdef XSYNC
+	if (c->alarm != None) XSyncDestroyAlarm(dis, c->alarm);
+#endif
+
+	c->next = free_clients;
+	free_clients = c;
+	dirty |= DIRTY_STATUS;
+}
+
+void restack(void)
+{
+	Client *current = desktops[current_desktop].current;
+	int n = 0, nfloat = 0;
+	int top = (current != NULL && current->isfull);
+
+	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
+		++n;
+		if (c->isfloat && !(top && c == current)) ++nfloat;
+	}
+	if (n > stacking_capacity || stacking == NULL) {
+		stacking_capacity = MAX(2*stacking_capacity, MAX(n, 16));
+		stacking = realloc(stacking, stacking_capacity * sizeof(Window));
+		stacking_applied = realloc(stacking_applied, stacking_capacity * sizeof(Window));
+		if (stacking == NULL || stacking_applied == NULL) die("cannot allocate stacking order");
+	}
+
+	// fullscreen current window on top of everything, then floating windows
+	// (the later in the list, the higher), then the current tiled window
+	if (top) stacking[0] = current->win;
+	int i = top + nfloat;
+	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
+		if (c->isfloat && !(top && c == current)) stacking[--i] = c->win;
+	}
+	i = top + nfloat;
+	if (current != NULL && !current->isfloat) stacking[i++] = current->win;
+	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
+		if (!c->isfloat && c != current) stacking[i++] = c->win;
+	}
+
+	if (n == stacking_applied_size && !memcmp(stacking, stacking_applied, n * sizeof(Window))) {
+		++suppressed_requests;
+		return;
+	}
+	if (n > 1) XRestackWindows(dis, stacking, n);
+
+	Window *tmp = stacking_applied;
+	stacking_applied = stacking;
+	stacking = tmp;
+	stacking_applied_size = n;
+}
+
+void send_kill_signal(Window w)
+{
+	XEvent ke;
+	ke.type = ClientMessage;
+	ke.xclient.window = w;
+	ke.xclient.format = 32;
+	ke.xclient.message_type = wmatoms[WM_PROTOCOLS];
+	ke.xclient.data.l[0] = wmatoms[WM_DELETE_WINDOW];
+	ke.xclient.data.l[1] = CurrentTime;
+	XSendEvent(dis, w, False, NoEventMask, &ke);
+}
+
+void runtime_path(char *path, size_t size, const char *extension)
+{
+	// one file per display, several instances of nuwm may run for the same user
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	snprintf(path, size, "%s/nuwm%s.%s", dir != NULL ? dir : "/tmp", DisplayString(dis), extension);
+}
+
+void send_configure(Client *c)
+{
+	// a resize waiting for the client is where the window is going
+	XConfigureEvent ce = {
+		.type = ConfigureNotify,
+		.display = dis,
+		.event = c->win,
+		.window = c->win,
+		.x = c->pending ? c->px : c->gx,
+		.y = c->pending ? c->py : c->gy,
+		.width = c->pending ? c->pw : c->gw,
+		.height = c->pending ? c->ph : c->gh,
+		.border_width = c->pending ? c->pbw : c->gbw,
+		.above = None,
+		.override_redirect = False,
+	};
+
+	XSendEvent(dis, c->win, False, StructureNotifyMask, (XEvent *)&ce);
+}
+
+void setfullscreen(Client *c, int fullscreen)
+{
+	int changed = (fullscreen != c->isfull);
+
+	if (fullscreen) {
+		Monitor *m = desktop_monitor(c->desktop);
+		c->isfull = c->isfloat = 1;
+		c->x = m->x;
+		c->y = m->y;
+		c->w = m->w;
+		c->h = m->h;
+		if (!c->hidden) place_client(c, c->x, c->y, c->w, c->h, 0);
+	} else {
+		c->isfull = c->isfloat = 0;
+		dirty |= DIRTY_LAYOUT;
+	}
+	if (changed) setnetstate(c);
+}
+
+void setnetstate(Client *c)
+{
+	Atom state[MAX_STATES + 3];
+	int n = c->nstates;
+	int published = (c->isfull ? 1 : 0) | (c->hidden ? 2 : 0) | (c->urgent ? 4 : 0);
+
+	if (published == c->published_state) {
+		++suppressed_requests;
+		return;
+	}
+	c->published_state = published;
+
+	memcpy(state, c->states, n * sizeof(Atom));
+	if (c->isfull) state[n++] = netatoms[NET_FULLSCREEN];
+	if (c->hidden) state[n++] = netatoms[NET_HIDDEN];
+	if (c->urgent) state[n++] = netatoms[NET_DEMANDS_ATTENTION];
+	XChangeProperty(dis, c->win, netatoms[NET_WM_STATE], XA_ATOM, 32, PropModeReplace, (unsigned char *) state, n);
+}
+
+void setwmstate(Client *c, long state)
+{
+	long data[] = { state, None };
+
+	XChangeProperty(dis, c->win, wmatoms[WM_STATE], wmatoms[WM_STATE], 32, PropModeReplace, (unsigned char *) data, 2);
+}
+
+void setup()
+{
+	LOG("setup started");
+	if ((dis = XOpenDisplay(NULL)) == NULL) die("cannot open display");
+#ifdef XCB
+	xcb = XGetXCBConnection(dis);
+#endif
 
 	// Error handling
 	xerrorxlib = XSetErrorHandler(xerrorstart);
@@ -731,7 +2266,23 @@ void setup()
 	XSync(dis, False);
 
 	// Install a signal
+#ifdef __linux__
+	// signals are read from a file descriptor in the main loop, not from handlers
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) die("cannot block signals");
+	if ((signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) die("cannot create signalfd");
+	if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) die("cannot create timerfd");
+	while (0 < waitpid(-1, NULL, WNOHANG));
+#else
 	sigchld(0);
+	sigusr1(0);
+#endif
+	dump_requested = 0;
 
 	// Screen and root window
 	screen = DefaultScreen(dis);
@@ -749,17 +2300,55 @@ void setup()
 	// set up atoms for dialog/notification windows
 	wmatoms[WM_PROTOCOLS]     = XInternAtom(dis, "WM_PROTOCOLS", False);
 	wmatoms[WM_DELETE_WINDOW] = XInternAtom(dis, "WM_DELETE_WINDOW", False);
+	wmatoms[WM_STATE]         = XInternAtom(dis, "WM_STATE", False);
 	netatoms[NET_SUPPORTED]   = XInternAtom(dis, "_NET_SUPPORTED", False);
 	netatoms[NET_WM_CHECK]    = XInternAtom(dis, "_NET_SUPPORTING_WM_CHECK", False);
 	netatoms[NET_WM_STATE]    = XInternAtom(dis, "_NET_WM_STATE", False);
 	netatoms[NET_ACTIVE]      = XInternAtom(dis, "_NET_ACTIVE_WINDOW", False);
 	netatoms[NET_CLIENT_LIST] = XInternAtom(dis, "_NET_CLIENT_LIST", False);
 	netatoms[NET_FULLSCREEN]  = XInternAtom(dis, "_NET_WM_STATE_FULLSCREEN", False);
+	netatoms[NET_HIDDEN]      = XInternAtom(dis, "_NET_WM_STATE_HIDDEN", False);
+	netatoms[NET_DEMANDS_ATTENTION] = XInternAtom(dis, "_NET_WM_STATE_DEMANDS_ATTENTION", False);
+	netatoms[NET_SYNC_REQUEST] = XInternAtom(dis, "_NET_WM_SYNC_REQUEST", False);
+	netatoms[NET_SYNC_COUNTER] = XInternAtom(dis, "_NET_WM_SYNC_REQUEST_COUNTER", False);
+	netatoms[NET_NUMBER_OF_DESKTOPS]   = XInternAtom(dis, "_NET_NUMBER_OF_DESKTOPS", False);
+	netatoms[NET_CURRENT_DESKTOP]      = XInternAtom(dis, "_NET_CURRENT_DESKTOP", False);
+	netatoms[NET_WM_DESKTOP]           = XInternAtom(dis, "_NET_WM_DESKTOP", False);
+	netatoms[NET_CLIENT_LIST_STACKING] = XInternAtom(dis, "_NET_CLIENT_LIST_STACKING", False);
+	netatoms[NET_WORKAREA]             = XInternAtom(dis, "_NET_WORKAREA", False);
+
+#ifdef XSYNC
+	// resizes are paced by the repaints of the clients, see sync_request()
+	int sync_error_base, major, minor;
+	have_sync = XSyncQueryExtension(dis, &sync_event_base, &sync_error_base)
+	            && XSyncInitialize(dis, &major, &minor);
+	if (!have_sync) LOG("no XSync extension, resizes are paced by RESIZE_HZ only");
+#endif
+
+#ifdef XINPUT2
+	// raw presses are sent to the root window whatever window they happen in
+	int xi_event, xi_error, xi_major = 2, xi_minor = 0;
+	have_xi = XQueryExtension(dis, "XInputExtension", &xi_opcode, &xi_event, &xi_error)
+	          && XIQueryVersion(dis, &xi_major, &xi_minor) == Success;
+	if (have_xi) {
+		unsigned char bits[XIMaskLen(XI_LASTEVENT)] = {0};
+		XIEventMask mask = { .deviceid = XIAllMasterDevices, .mask_len = sizeof(bits), .mask = bits };
+		XISetMask(bits, XI_RawButtonPress);
+		XISelectEvents(dis, root, &mask, 1);
+	} else {
+		LOG("no XInput2 extension, click-to-focus uses button grabs");
+	}
+#endif
 
 	// propagate EWMH support
 	XChangeProperty(dis, root, netatoms[NET_SUPPORTED], XA_ATOM, 32,
 	                PropModeReplace, (unsigned char *)netatoms, NET_COUNT);
 
+	// desktops never change in number, the rest is written by write_info()
+	long ndesktops = DESKTOPS_SIZE - 1;
+	XChangeProperty(dis, root, netatoms[NET_NUMBER_OF_DESKTOPS], XA_CARDINAL, 32,
+	                PropModeReplace, (unsigned char *) &ndesktops, 1);
+
 	// create supporting window (for _NET_SUPPORTING_WM_CHECK)
 	wmcheckwin = XCreateSimpleWindow(dis, root, 0, 0, 1, 1, 0, 0, 0);
 	XChangeProperty(dis, wmcheckwin, netatoms[NET_WM_CHECK], XA_WINDOW, 32,
@@ -770,6 +2359,11 @@ void setup()
 	LOG("grab keys");
 	// Shortcuts
 	grabkeys();
+	grabdrag();
+
+	// Commands and state changes on a socket, the state in shared memory
+	ipc_setup();
+	snapshot_setup();
 
 	// Set up all desktop
 	for (int i = 0; i < DESKTOPS_SIZE; ++i) {
@@ -777,16 +2371,62 @@ void setup()
 		desktops[i].mode = MONOCLE;
 		desktops[i].head = NULL;
 		desktops[i].current = NULL;
+		desktops[i].monitor = -1;
 	}
 
+	// Monitors show the first desktops, the first one is selected
+#ifdef XRANDR
+	int randr_error_base;
+	have_randr = XRRQueryExtension(dis, &randr_event_base, &randr_error_base);
+	if (have_randr) XRRSelectInput(dis, root, RRScreenChangeNotifyMask);
+#endif
+	update_monitors();
+
 	// Select first dekstop by default
 	const Arg arg = { .i = 1 };
 	change_desktop(&arg);
+	for (int i = 0; i < nmonitors; ++i) {
+		desktops[monitors[i].desktop].origin_x = monitors[i].x;
+		desktops[monitors[i].desktop].origin_y = monitors[i].y;
+	}
+
+	// To catch maprequest and destroynotify (if other wm running), and size changes of the screen
+	XSelectInput(dis, root, SubstructureNotifyMask|SubstructureRedirectMask|ButtonPressMask|StructureNotifyMask);
+}
 
-	// To catch maprequest and destroynotify (if other wm running)
-	XSelectInput(dis, root, SubstructureNotifyMask|SubstructureRedirectMask|ButtonPressMask);
+void show_client(Client *c)
+{
+	c->hidden = 0;
+	if (!c->mapped) {
+		XMapWindow(dis, c->win);
+		c->mapped = 1;
+		setwmstate(c, NormalState);
+	}
+	setnetstate(c);
 }
 
+void handle_signals(void)
+{
+#ifdef __linux__
+	struct signalfd_siginfo si;
+
+	while (read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+		switch (si.ssi_signo) {
+		case SIGCHLD: while (0 < waitpid(-1, NULL, WNOHANG)); break;
+		case SIGUSR1: dump_requested = 1; break;
+		case SIGHUP:
+		case SIGTERM: bool_quit = keep_clients = 1; break;
+		}
+	}
+#endif
+	if (dump_requested) {
+		dump_requested = 0;
+		dump_trace();
+		dump_stats();
+	}
+}
+
+#ifndef __linux__
 void sigchld(int unused)
 {
 	// Again, thx to dwm ;)
@@ -795,33 +2435,202 @@ void sigchld(int unused)
 	while (0 < waitpid(-1, NULL, WNOHANG));
 }
 
+void sigusr1(int unused)
+{
+	if (signal(SIGUSR1, sigusr1) == SIG_ERR) die("can't install SIGUSR1 handler");
+
+	// dumped from the event loop, stdio is not async-signal-safe
+	dump_requested = 1;
+}
+#endif
+
+void snapshot_setup(void)
+{
+	runtime_path(snapshot_path, sizeof(snapshot_path), "state");
+
+	// a fresh file only the user can read, never whatever the name already points to
+	unlink(snapshot_path);
+	int fd = open(snapshot_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0 || ftruncate(fd, sizeof(Snapshot)) < 0) {
+		LOGL(LOG_ERROR, "cannot create %s, no snapshot", snapshot_path);
+		if (fd >= 0) close(fd);
+		return;
+	}
+	snapshot = mmap(NULL, sizeof(Snapshot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (snapshot == MAP_FAILED) {
+		LOGL(LOG_ERROR, "cannot map %s, no snapshot", snapshot_path);
+		snapshot = NULL;
+		return;
+	}
+	snapshot->version = SNAPSHOT_VERSION;
+	snapshot->ndesktops = DESKTOPS_SIZE;
+}
+
+void snapshot_write(void)
+{
+	if (snapshot == NULL) return;
+
+	// odd sequence while writing, readers retry until they see the same even value twice
+	++snapshot->seq;
+	__sync_synchronize();
+
+	snapshot->current_desktop = current_desktop;
+	snapshot->focused = focused != NULL ? focused->win : None;
+	int n = 0;
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		snapshot->desktops[i].mode = desktops[i].mode;
+		snapshot->desktops[i].nclients = snapshot->desktops[i].nfloating = snapshot->desktops[i].nfullscreen = 0;
+		for (Client *c = desktops[i].head; c != NULL; c = c->next, ++n) {
+			++snapshot->desktops[i].nclients;
+			snapshot->desktops[i].nfloating += c->isfloat;
+			snapshot->desktops[i].nfullscreen += c->isfull;
+			if (n >= SNAPSHOT_CLIENTS) continue;
+			snapshot->clients[n].window = c->win;
+			snapshot->clients[n].desktop = i;
+			snapshot->clients[n].flags = (c->isfloat ? SNAPSHOT_FLOATING : 0) | (c->isfull ? SNAPSHOT_FULLSCREEN : 0)
+			                             | (c == focused ? SNAPSHOT_FOCUSED : 0);
+		}
+	}
+	snapshot->nclients = n;
+
+	__sync_synchronize();
+	++snapshot->seq;
+}
+
 void start()
 {
 	XEvent ev;
 
-	write_info();
-	while (!bool_quit && !XNextEvent(dis, &ev)) {
-		LOG("event loop iteration");
-		if (ev.type < LASTEvent && events[ev.type] != NULL) {
-			events[ev.type](&ev);
+	flush();
+	while (!bool_quit) {
+		// paced resizes and drags are sent when their time comes, unless an event comes first
+		unsigned long long deadline = place_pending();
+		unsigned long long drag_deadline = drag_update();
+		if (drag_deadline != 0 && (deadline == 0 || drag_deadline < deadline)) deadline = drag_deadline;
+
+		// XPending flushes the requests and reads what the server has sent so far
+		if (XPending(dis) == 0) {
+			wait_events(deadline);
+			handle_signals();
+			flush(); // for commands read from the IPC socket
+			continue;
 		}
+
+		// handle everything that is already queued, then relayout once
+		do {
+			XNextEvent(dis, &ev);
+			++nevents;
+			if (ev.type < LASTEvent && events[ev.type] != NULL) {
+				Probe probe;
+				probe_start(&probe);
+				events[ev.type](&ev);
+				trace(&ev, probe.time, probe_stop(&probe, &event_stats[ev.type]));
+			}
+#ifdef XSYNC
+			else if (have_sync && ev.type == sync_event_base + XSyncAlarmNotify) alarmnotify(&ev);
+#endif
+#ifdef XRANDR
+			else if (have_randr && ev.type == randr_event_base + RRScreenChangeNotify) {
+				XRRUpdateConfiguration(&ev);
+				sw = XDisplayWidth(dis, screen);
+				sh = XDisplayHeight(dis, screen);
+				update_monitors();
+			}
+#endif
+		} while (!bool_quit && XPending(dis) > 0);
+		flush();
 	}
 }
 
+#ifdef XSYNC
+void sync_request(Client *c)
+{
+	XSyncValue value;
+
+	// start above the current value of the counter, the client may have bumped it already
+	if (c->sync_value == 0) {
+		if (!XSyncQueryCounter(dis, c->counter, &value)) {
+			c->counter = None;
+			return;
+		}
+		c->sync_value = (unsigned long long)XSyncValueHigh32(value) << 32 | XSyncValueLow32(value);
+	}
+	++c->sync_value;
+	XSyncIntsToValue(&value, c->sync_value & 0xffffffff, c->sync_value >> 32);
+
+	XEvent ev = { .type = ClientMessage };
+	ev.xclient.window = c->win;
+	ev.xclient.message_type = wmatoms[WM_PROTOCOLS];
+	ev.xclient.format = 32;
+	ev.xclient.data.l[0] = netatoms[NET_SYNC_REQUEST];
+	ev.xclient.data.l[1] = CurrentTime;
+	ev.xclient.data.l[2] = XSyncValueLow32(value);
+	ev.xclient.data.l[3] = XSyncValueHigh32(value);
+	XSendEvent(dis, c->win, False, NoEventMask, &ev);
+
+	// the alarm goes off once the client has drawn the frame at the new size
+	XSyncAlarmAttributes attrs;
+	attrs.trigger.counter = c->counter;
+	attrs.trigger.value_type = XSyncAbsolute;
+	attrs.trigger.wait_value = value;
+	attrs.trigger.test_type = XSyncPositiveComparison;
+	XSyncIntToValue(&attrs.delta, 0);
+	attrs.events = True;
+	unsigned long mask = XSyncCACounter | XSyncCAValueType | XSyncCAValue | XSyncCATestType | XSyncCADelta | XSyncCAEvents;
+	if (c->alarm == None) {
+		c->alarm = XSyncCreateAlarm(dis, mask, &attrs);
+	} else {
+		XSyncChangeAlarm(dis, c->alarm, mask, &attrs);
+	}
+	c->sync_deadline = now() + SYNC_TIMEOUT_MS * 1000000ULL;
+}
+
+void alarmnotify(XEvent *e)
+{
+	XSyncAlarmNotifyEvent *ev = (XSyncAlarmNotifyEvent *)e;
+
+	for (int i = 0; i < nmonitors; ++i) {
+		for (Client *c = desktops[monitors[i].desktop].head; c != NULL; c = c->next) {
+			if (c->alarm != ev->alarm) continue;
+			c->sync_deadline = 0;
+			if (c->pending) {
+				c->pending = 0;
+				place_client(c, c->px, c->py, c->pw, c->ph, c->pbw);
+			}
+			return;
+		}
+	}
+}
+#endif
+
 void tile()
 {
+	// place_client() only sends what changed, monitors left alone cost nothing
+	for (int i = 0; i < nmonitors; ++i) tile_monitor(&monitors[i]);
+}
+
+void tile_monitor(Monitor *m)
+{
+	Desktop *d = &desktops[m->desktop];
 	Client *master = NULL;
-	Client *current = desktops[current_desktop].current;
 	int stack_size = 0;
 
-	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
-		if (c->isfloat) {
-			if (c->isfull) {
-				XSetWindowBorderWidth(dis, c->win, 0);
-			} else {
-				XSetWindowBorderWidth(dis, c->win, BORDER);
-			}
-			XMoveResizeWindow(dis, c->win, c->x, c->y, c->w, c->h);
+	// floating windows move along when the desktop is shown on another monitor
+	int dx = m->x - d->origin_x, dy = m->y - d->origin_y;
+	d->origin_x = m->x;
+	d->origin_y = m->y;
+
+	for (Client *c = d->head; c != NULL; c = c->next) {
+		if (c->isfull) {
+			// follows the monitor when it changes
+			c->x = m->x;
+			c->y = m->y;
+			c->w = m->w;
+			c->h = m->h;
+			place_client(c, c->x, c->y, c->w, c->h, 0);
+		} else if (c->isfloat) {
+			move_resize_floating(c, c->x + dx, c->y + dy, c->w, c->h);
 		} else {
 			if (master == NULL) {
 				master = c;
@@ -830,122 +2639,357 @@ void tile()
 			}
 		}
 	}
-	if (master == NULL) {
-		update_focus();
-		return;
-	}
+	if (master == NULL) return;
 
 	int w, h, x, y, ms;
 	if (stack_size == 0) {
-		XSetWindowBorderWidth(dis, master->win, 0);
-		XMoveResizeWindow(dis, master->win, 0, BAR, sw, sh - BAR);
+		place_client(master, m->x, m->y + BAR, m->w, m->h - BAR, 0);
 	} else {
-		switch (desktops[current_desktop].mode) {
+		switch (d->mode) {
 		case VSTACK:
-			ms = desktops[current_desktop].master_size * (sw - 2*BORDER - GAP) / 100;
+			ms = d->master_size * (m->w - 2*BORDER - GAP) / 100;
 
 			// Master window
 			w = ms - 2*BORDER;
-			h = sh - 2*BORDER - BAR;
-			XSetWindowBorderWidth(dis, master->win, BORDER);
-			XMoveResizeWindow(dis, master->win, 0, BAR, w, h);
-
-			x = ms + 2*BORDER + GAP;
-			y = BAR;
-			w = sw - ms - 4*BORDER - GAP;
-			h = (sh - 2*stack_size*BORDER - (stack_size - 1)*GAP - BAR) / stack_size;
+			h = m->h - 2*BORDER - BAR;
+			place_client(master, m->x, m->y + BAR, w, h, BORDER);
+
+			x = m->x + ms + 2*BORDER + GAP;
+			y = m->y + BAR;
+			w = m->w - ms - 4*BORDER - GAP;
+			h = (m->h - 2*stack_size*BORDER - (stack_size - 1)*GAP - BAR) / stack_size;
 			for (Client *c = master->next; c != NULL; c = c->next) {
 				if (c->isfloat) continue;
-				XSetWindowBorderWidth(dis, c->win, BORDER);
-				XMoveResizeWindow(dis, c->win, x, y, w, h);
+				place_client(c, x, y, w, h, BORDER);
 				y += h + 2*BORDER + GAP;
 			}
 			break;
 		case HSTACK:
-			ms = desktops[current_desktop].master_size * (sh - BAR - 2*BORDER - GAP) / 100;
+			ms = d->master_size * (m->h - BAR - 2*BORDER - GAP) / 100;
 
 			// Master window
-			w = sw - 2*BORDER;
+			w = m->w - 2*BORDER;
 			h = ms - 2*BORDER;
-			XSetWindowBorderWidth(dis, master->win, BORDER);
-			XMoveResizeWindow(dis, master->win, 0, BAR, w, h);
+			place_client(master, m->x, m->y + BAR, w, h, BORDER);
 
-			x = 0;
-			h = sh - ms - 4*BORDER - GAP - BAR;
-			w = (sw - 2*stack_size*BORDER - (stack_size - 1)*GAP) / stack_size;
+			x = m->x;
+			h = m->h - ms - 4*BORDER - GAP - BAR;
+			w = (m->w - 2*stack_size*BORDER - (stack_size - 1)*GAP) / stack_size;
 			for (Client *c = master->next; c != NULL; c = c->next) {
 				if (c->isfloat) continue;
-				XSetWindowBorderWidth(dis, c->win, BORDER);
-				XMoveResizeWindow(dis, c->win, x, GAP + BAR + ms, w, h);
+				place_client(c, x, m->y + GAP + BAR + ms, w, h, BORDER);
 				x += w + 2*BORDER + GAP;
 			}
 
 			break;
 		case MONOCLE:
-			if (current != NULL && !current->isfloat) {
-				XSetWindowBorderWidth(dis, current->win, 0);
-				XMoveResizeWindow(dis, current->win, 0, BAR, sw, sh - BAR);
-			}
 			for (Client *c = master; c != NULL; c = c->next) {
 				if (c->isfloat) continue;
-				XSetWindowBorderWidth(dis, c->win, 0);
-				XMoveResizeWindow(dis, c->win, 0, BAR, sw, sh - BAR);
+				place_client(c, m->x, m->y + BAR, m->w, m->h - BAR, 0);
 			}
 			break;
 		default:
 			break;
 		}
 	}
-	update_focus();
+}
+
+void trace(XEvent *e, unsigned long long begin, unsigned long long end)
+{
+	Trace *t = &traces[ntraces++ & (TRACE_SIZE - 1)];
+
+	t->time = begin;
+	t->type = e->type;
+	t->duration = end - begin;
+	switch (e->type) {
+	case ConfigureRequest: t->win = e->xconfigurerequest.window; break;
+	case DestroyNotify:    t->win = e->xdestroywindow.window; break;
+	case MapRequest:       t->win = e->xmaprequest.window; break;
+	case UnmapNotify:      t->win = e->xunmap.window; break;
+	default:               t->win = e->xany.window; break;
+	}
+}
+
+void unlink_client(Desktop *d, Client *c)
+{
+	if (c == d->head) {
+		d->head = c->next;
+	} else {
+		c->prev->next = c->next;
+	}
+
+	if (c->next != NULL) {
+		c->next->prev = c->prev;
+	} else if (d->head != NULL) {
+		d->head->prev = c->prev; // c was the tail
+	}
+	c->next = c->prev = NULL;
 }
 
 void update_focus()
 {
 	Client *current = desktops[current_desktop].current;
 
-	/* grab/ungrab buttons, set borders */
-	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
-		XUngrabButton(dis, AnyButton, AnyModifier, c->win);
-
-		if (current == c) {
-			XSetWindowBorder(dis, c->win, win_focus);
-			XSetInputFocus(dis, c->win, RevertToParent, CurrentTime);
-			XChangeProperty(dis, root, netatoms[NET_ACTIVE], XA_WINDOW, 32, PropModeReplace, (unsigned char *) &(c->win), 1);
-		} else {
-			XSetWindowBorder(dis, c->win, win_unfocus);
-			XGrabButton(dis, AnyButton, AnyModifier, c->win, False, ButtonPressMask, GrabModeAsync, GrabModeAsync, None, None);
+	/* grab/ungrab buttons, set borders, only for the windows losing or getting focus */
+	if (current != focused) {
+		if (focused != NULL) {
+			XSetWindowBorder(dis, focused->win, win_unfocus);
+			if (!CLICK_ON_ROOT) grabbuttons(focused->win);
+		}
+		if (current != NULL) {
+			if (!CLICK_ON_ROOT) XUngrabButton(dis, AnyButton, AnyModifier, current->win);
+			XSetWindowBorder(dis, current->win, win_focus);
+			XSetInputFocus(dis, current->win, RevertToParent, CurrentTime);
+			if (current->urgent) {
+				current->urgent = 0;
+				setnetstate(current);
+			}
 		}
+		focused = current;
+	}
+
+	// None once the desktop is empty, the last focused window may be gone already
+	Window active = current != NULL ? current->win : None;
+	if (active != active_published) {
+		XChangeProperty(dis, root, netatoms[NET_ACTIVE], XA_WINDOW, 32, PropModeReplace, (unsigned char *) &active, 1);
+		active_published = active;
 	}
 
 	/* reorder windows */
-	if (current != NULL) XRaiseWindow(dis, current->win);
-	for (Client *c = desktops[current_desktop].head; c != NULL; c = c->next) {
-		if (c->isfloat || c->isfull) XRaiseWindow(dis, c->win);
+	restack();
+}
+
+void update_monitors(void)
+{
+	Monitor found[MAX_MONITORS];
+	int n = 0;
+
+#ifdef XRANDR
+	if (have_randr) {
+		int max = MIN(MAX_MONITORS, DESKTOPS_SIZE - 1); /* every monitor needs a desktop of its own */
+		XRRScreenResources *res = XRRGetScreenResourcesCurrent(dis, root);
+		for (int i = 0; res != NULL && i < res->ncrtc && n < max; ++i) {
+			XRRCrtcInfo *crtc = XRRGetCrtcInfo(dis, res, res->crtcs[i]);
+			if (crtc == NULL) continue;
+
+			// disabled crtcs have no mode, mirrored outputs share one area
+			int dup = (crtc->mode == None || crtc->noutput == 0);
+			for (int j = 0; j < n && !dup; ++j) {
+				dup = (found[j].x == crtc->x && found[j].y == crtc->y && found[j].w == crtc->width && found[j].h == crtc->height);
+			}
+			if (!dup) found[n++] = (Monitor){ crtc->x, crtc->y, crtc->width, crtc->height, 0 };
+			XRRFreeCrtcInfo(crtc);
+		}
+		if (res != NULL) XRRFreeScreenResources(res);
 	}
-	if (current != NULL && current->isfull) XRaiseWindow(dis, current->win);
+#endif
+	if (n == 0) found[n++] = (Monitor){ 0, 0, sw, sh, 0 };
+
+	// monitors keep their desktop by position, unplugging one leaves the others alone
+	int taken[MAX_MONITORS] = {0};
+	for (int i = 0; i < n; ++i) {
+		for (int j = 0; j < nmonitors && found[i].desktop == 0; ++j) {
+			if (!taken[j] && monitors[j].x == found[i].x && monitors[j].y == found[i].y) {
+				found[i].desktop = monitors[j].desktop;
+				taken[j] = 1;
+			}
+		}
+	}
+	// the others take the desktop of a monitor that went away, or the first one nobody shows
+	for (int i = 0; i < n; ++i) {
+		for (int j = 0; j < nmonitors && found[i].desktop == 0; ++j) {
+			if (!taken[j]) {
+				found[i].desktop = monitors[j].desktop;
+				taken[j] = 1;
+			}
+		}
+		for (int d = 1; d < DESKTOPS_SIZE && found[i].desktop == 0; ++d) {
+			int free = (desktops[d].monitor < 0);
+			for (int k = 0; k < i && free; ++k) free = (found[k].desktop != d);
+			if (free) found[i].desktop = d;
+		}
+	}
+	if (n == nmonitors && !memcmp(found, monitors, n * sizeof(Monitor))) return;
+
+	// the selected monitor stays selected wherever it went
+	int sel = 0;
+	for (int i = 0; i < n && nmonitors > 0; ++i) {
+		if (found[i].desktop == monitors[selmon].desktop) sel = i;
+	}
+
+	LOG("%d monitor(s)", n);
+	for (int i = 0; i < nmonitors; ++i) desktops[monitors[i].desktop].monitor = -1;
+	for (int i = 0; i < n; ++i) desktops[found[i].desktop].monitor = i;
+	memcpy(monitors, found, n * sizeof(Monitor));
+	nmonitors = n;
+	selmon = sel;
+	current_desktop = monitors[selmon].desktop;
+	dirty |= DIRTY_DESKTOP | DIRTY_LAYOUT | DIRTY_STATUS;
+}
+
+void wait_events(unsigned long long deadline)
+{
+	struct pollfd fds[4 + IPC_CLIENTS] = {{ .fd = ConnectionNumber(dis), .events = POLLIN }};
+	int nfds = 1;
+
+#ifdef __linux__
+	// the deadline is kept on the timer, with nothing to wait for nuwm sleeps until woken
+	if (deadline != timer_armed) {
+		struct itimerspec its = {{0, 0}, {deadline / 1000000000ULL, deadline % 1000000000ULL}};
+		timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+		timer_armed = deadline;
+	}
+	fds[nfds++] = (struct pollfd){ .fd = signal_fd, .events = POLLIN };
+	fds[nfds++] = (struct pollfd){ .fd = timer_fd, .events = POLLIN };
+	int timeout = -1;
+#else
+	// signal handlers interrupt poll, they are handled right after
+	unsigned long long t = now();
+	int timeout = deadline == 0 ? -1 : deadline > t ? (deadline - t) / 1000000 + 1 : 0;
+#endif
+	int ipc_first = nfds;
+	nfds += ipc_pollfds(fds + nfds);
+
+	if (poll(fds, nfds, timeout) <= 0) return;
+#ifdef __linux__
+	if (fds[2].revents & POLLIN) {
+		uint64_t expirations;
+		if (read(timer_fd, &expirations, sizeof(expirations)) > 0) timer_armed = 0;
+	}
+#endif
+	ipc_handle(fds + ipc_first, nfds - ipc_first);
 }
 
 void write_info(void)
 {
 	char status[512] = {0};
-	int length = 0;
+	int length = 0, n = 0;
+
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) ++n;
+	}
+	if (n > clientlist_capacity || clientlist == NULL) {
+		clientlist_capacity = MAX(2*clientlist_capacity, MAX(n, 16));
+		clientlist = realloc(clientlist, clientlist_capacity * sizeof(Window));
+		clientlist_published = realloc(clientlist_published, clientlist_capacity * sizeof(Window));
+		if (clientlist == NULL || clientlist_published == NULL) die("cannot allocate client list");
+	}
 
-	XDeleteProperty(dis, root, netatoms[NET_CLIENT_LIST]);
+	n = 0;
 	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
 		int nclients = 0;
 		for (Client *c = desktops[i].head; c != NULL; c = c->next) {
 			++nclients;
-			XChangeProperty(dis, root, netatoms[NET_CLIENT_LIST],
-			                XA_WINDOW, 32, PropModeAppend, (unsigned char *) &(c->win), 1);
+			clientlist[n++] = c->win;
+			if (c->published_desktop != i) {
+				long index = i - 1;
+				XChangeProperty(dis, c->win, netatoms[NET_WM_DESKTOP], XA_CARDINAL, 32,
+				                PropModeReplace, (unsigned char *) &index, 1);
+				c->published_desktop = i;
+			}
 		}
 		length += snprintf(status + length, 512 - length, "%c:%d:%d:%d ",
 		                   i == current_desktop ? '*' : '-', i, desktops[i].mode, nclients);
 	}
-	XStoreName(dis, root, status);
+
+	// publish only what has changed, every request wakes up bars and pagers
+	if (n != clientlist_published_size || memcmp(clientlist, clientlist_published, n * sizeof(Window))) {
+		XChangeProperty(dis, root, netatoms[NET_CLIENT_LIST], XA_WINDOW, 32,
+		                PropModeReplace, (unsigned char *) clientlist, n);
+		Window *tmp = clientlist_published;
+		clientlist_published = clientlist;
+		clientlist = tmp;
+		clientlist_published_size = n;
+	} else {
+		++suppressed_requests;
+	}
+	if (current_desktop != desktop_published) {
+		long index = current_desktop - 1;
+		XChangeProperty(dis, root, netatoms[NET_CURRENT_DESKTOP], XA_CARDINAL, 32,
+		                PropModeReplace, (unsigned char *) &index, 1);
+		desktop_published = current_desktop;
+	} else {
+		++suppressed_requests;
+	}
+
+	// the work area of a desktop is the monitor showing it, or the selected one for hidden desktops
+	long workarea[4 * (DESKTOPS_SIZE - 1)];
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		Monitor *m = desktop_monitor(i);
+		workarea[4*(i - 1)] = m->x;
+		workarea[4*(i - 1) + 1] = m->y + BAR;
+		workarea[4*(i - 1) + 2] = m->w;
+		workarea[4*(i - 1) + 3] = m->h - BAR;
+	}
+	if (memcmp(workarea, workarea_published, sizeof(workarea))) {
+		XChangeProperty(dis, root, netatoms[NET_WORKAREA], XA_CARDINAL, 32,
+		                PropModeReplace, (unsigned char *) workarea, 4 * (DESKTOPS_SIZE - 1));
+		memcpy(workarea_published, workarea, sizeof(workarea));
+	} else {
+		++suppressed_requests;
+	}
+	if (strcmp(status, status_published)) {
+		XStoreName(dis, root, status);
+		memcpy(status_published, status, sizeof(status));
+	} else {
+		++suppressed_requests;
+	}
+}
+
+void write_stacking(void)
+{
+	int n = 0;
+
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) ++n;
+	}
+	if (n > stacklist_capacity || stacklist == NULL) {
+		stacklist_capacity = MAX(2*stacklist_capacity, MAX(n, 16));
+		stacklist = realloc(stacklist, stacklist_capacity * sizeof(Window));
+		stacklist_published = realloc(stacklist_published, stacklist_capacity * sizeof(Window));
+		if (stacklist == NULL || stacklist_published == NULL) die("cannot allocate stacking list");
+	}
+
+	// hidden desktops at the bottom, then the other monitors, then the current desktop as
+	// restack() left it. restack() only orders the current desktop, the other visible ones
+	// are listed as it ordered them when they were current: tiled windows below floating ones
+	n = 0;
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		if (desktops[i].monitor >= 0) continue;
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) stacklist[n++] = c->win;
+	}
+	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
+		if (desktops[i].monitor < 0 || i == current_desktop) continue;
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) {
+			if (!c->isfloat) stacklist[n++] = c->win;
+		}
+		for (Client *c = desktops[i].head; c != NULL; c = c->next) {
+			if (c->isfloat) stacklist[n++] = c->win;
+		}
+	}
+	for (int i = stacking_applied_size - 1; i >= 0; --i) stacklist[n++] = stacking_applied[i];
+
+	if (n == stacklist_published_size && !memcmp(stacklist, stacklist_published, n * sizeof(Window))) {
+		++suppressed_requests;
+		return;
+	}
+	XChangeProperty(dis, root, netatoms[NET_CLIENT_LIST_STACKING], XA_WINDOW, 32,
+	                PropModeReplace, (unsigned char *) stacklist, n);
+	Window *tmp = stacklist_published;
+	stacklist_published = stacklist;
+	stacklist = tmp;
+	stacklist_published_size = n;
 }
 
 int xerror(Display *dpy, XErrorEvent *ee)
 {
+	for (int i = 0; i < IGNORED_SERIALS; ++i) {
+		if (ignored_serials[i] == ee->serial) {
+			DEBUG("ignore error: serial=%lu, request code=%d, error code=%d", ee->serial, ee->request_code, ee->error_code);
+			return 0;
+		}
+	}
+
 	// thx to berrywm
 	if (ee->error_code == BadWindow
 	    || (ee->request_code == X_SetInputFocus && ee->error_code == BadMatch)
@@ -971,13 +3015,11 @@ int xerrorstart(Display *dpy, XErrorEvent *ee)
 
 int wintoclient(Window w, Client **c, int *desktop)
 {
-	for (int i = 1; i < DESKTOPS_SIZE; ++i) {
-		for (Client *cur = desktops[i].head; cur != NULL; cur = cur->next) {
-			if (cur->win == w) {
-				if (c) *c = cur;
-				if (desktop) *desktop = i;
-				return 1;
-			}
+	for (Client *cur = winindex[w & (INDEX_SIZE - 1)]; cur != NULL; cur = cur->hnext) {
+		if (cur->win == w) {
+			if (c) *c = cur;
+			if (desktop) *desktop = cur->desktop;
+			return 1;
 		}
 	}
 	return 0;
@@ -988,7 +3030,7 @@ int main(int argc, char **argv)
 	setup();
 
 #ifdef __OpenBSD__
-	if (pledge("stdio rpath proc exec", NULL) == -1)
+	if (pledge("stdio rpath cpath proc exec unix", NULL) == -1)
 		die("pledge");
 #endif
 
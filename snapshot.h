@@ -0,0 +1,47 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ *  Layout of the state snapshot nuwm keeps in $XDG_RUNTIME_DIR/nuwm$DISPLAY.state
+ *  (/tmp without XDG_RUNTIME_DIR), readable by its user only. Readers map the file
+ *  read-only and copy it with the sequence lock:
+ *
+ *      do {
+ *          while ((seq = s->seq) & 1);
+ *          __sync_synchronize();
+ *          copy = *s;
+ *          __sync_synchronize();
+ *      } while (s->seq != seq);
+ *
+ *  The layout only changes along with SNAPSHOT_VERSION.
+ */
+
+#include <stdint.h>
+
+#define SNAPSHOT_VERSION  1
+#define SNAPSHOT_DESKTOPS 16
+#define SNAPSHOT_CLIENTS  1024 /* clients beyond are counted but not listed */
+
+enum { SNAPSHOT_FLOATING = 1 << 0, SNAPSHOT_FULLSCREEN = 1 << 1, SNAPSHOT_FOCUSED = 1 << 2 };
+
+typedef struct Snapshot Snapshot;
+struct Snapshot {
+	uint32_t version;
+	volatile uint32_t seq; /* odd while nuwm is writing */
+	uint32_t current_desktop;
+	uint32_t ndesktops; /* desktops[0] is unused, like in nuwm */
+	uint64_t focused; /* window, 0 when none */
+	struct {
+		uint32_t mode; /* 0 monocle, 1 vertical stack, 2 horizontal stack */
+		uint32_t nclients, nfloating, nfullscreen;
+	} desktops[SNAPSHOT_DESKTOPS];
+	uint32_t nclients;
+	uint32_t pad;
+	struct {
+		uint64_t window;
+		uint32_t desktop;
+		uint32_t flags; /* SNAPSHOT_FLOATING, SNAPSHOT_FULLSCREEN, SNAPSHOT_FOCUSED */
+	} clients[SNAPSHOT_CLIENTS];
+};
+
+#endif // SNAPSHOT_H